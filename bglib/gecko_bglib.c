@@ -1,68 +1,760 @@
 #include "gecko_bglib.h"
 
-struct gecko_cmd_packet* gecko_wait_message(void)
-{//wait for event from system
-    uint32_t msg_length;
-    uint32_t header;
-    uint8_t  *payload;
-    struct gecko_cmd_packet* pck;
-    int      ret;
-    //sync to header byte
-    ret = bglib_input(1, (uint8_t*)&header);
-    if (ret < 0 || (header&0x78) != gecko_dev_type_gecko)
+#include <stdlib.h>
+#include <string.h>
+#ifdef BGLIB_THREAD
+#include <poll.h>
+#include <pthread.h>
+#endif
+
+/** Payload length of each known message, sorted by message ID */
+struct gecko_msg_info
+{
+    uint32_t id;
+    uint16_t len;                    /* payload length, minimum length if variable */
+    uint8_t  variable;               /* ends with a length prefixed array */
+};
+
+static const struct gecko_msg_info gecko_msg_infos[] =
+{
+    { gecko_rsp_dfu_reset_id,                                        0,                                                           0 },
+    { gecko_evt_dfu_boot_id,                                         sizeof(struct gecko_msg_dfu_boot_evt_t),                     0 },
+    { gecko_rsp_system_hello_id,                                     sizeof(struct gecko_msg_system_hello_rsp_t),                 0 },
+    { gecko_evt_system_boot_id,                                      sizeof(struct gecko_msg_system_boot_evt_t),                  0 },
+    { gecko_rsp_le_gap_open_id,                                      sizeof(struct gecko_msg_le_gap_open_rsp_t),                  0 },
+    { gecko_evt_le_gap_scan_response_id,                             sizeof(struct gecko_msg_le_gap_scan_response_evt_t),         1 },
+    { gecko_rsp_le_connection_set_parameters_id,                     sizeof(struct gecko_msg_le_connection_set_parameters_rsp_t), 0 },
+    { gecko_evt_le_connection_opened_id,                             sizeof(struct gecko_msg_le_connection_opened_evt_t),         0 },
+    { gecko_rsp_gatt_set_max_mtu_id,                                 sizeof(struct gecko_msg_gatt_set_max_mtu_rsp_t),             0 },
+    { gecko_evt_gatt_mtu_exchanged_id,                               sizeof(struct gecko_msg_gatt_mtu_exchanged_evt_t),           0 },
+    { gecko_rsp_gatt_server_read_attribute_value_id,                 sizeof(struct gecko_msg_gatt_server_read_attribute_value_rsp_t), 1 },
+    { gecko_evt_gatt_server_attribute_value_id,                      sizeof(struct gecko_msg_gatt_server_attribute_value_evt_t),  1 },
+    { gecko_rsp_endpoint_send_id,                                    sizeof(struct gecko_msg_endpoint_send_rsp_t),                0 },
+    { gecko_evt_endpoint_syntax_error_id,                            sizeof(struct gecko_msg_endpoint_syntax_error_evt_t),        0 },
+    { gecko_rsp_hardware_set_soft_timer_id,                          sizeof(struct gecko_msg_hardware_set_soft_timer_rsp_t),      0 },
+    { gecko_evt_hardware_soft_timer_id,                              sizeof(struct gecko_msg_hardware_soft_timer_evt_t),          0 },
+    { gecko_rsp_flash_ps_dump_id,                                    sizeof(struct gecko_msg_flash_ps_dump_rsp_t),                0 },
+    { gecko_evt_flash_ps_key_id,                                     sizeof(struct gecko_msg_flash_ps_key_evt_t),                 1 },
+    { gecko_rsp_test_dtm_tx_id,                                      sizeof(struct gecko_msg_test_dtm_tx_rsp_t),                  0 },
+    { gecko_evt_test_dtm_completed_id,                               sizeof(struct gecko_msg_test_dtm_completed_evt_t),           0 },
+    { gecko_rsp_sm_set_bondable_mode_id,                             sizeof(struct gecko_msg_sm_set_bondable_mode_rsp_t),         0 },
+    { gecko_evt_sm_passkey_display_id,                               sizeof(struct gecko_msg_sm_passkey_display_evt_t),           0 },
+    { gecko_rsp_dfu_flash_set_address_id,                            sizeof(struct gecko_msg_dfu_flash_set_address_rsp_t),        0 },
+    { gecko_rsp_system_reset_id,                                     0,                                                           0 },
+    { gecko_rsp_le_gap_set_mode_id,                                  sizeof(struct gecko_msg_le_gap_set_mode_rsp_t),              0 },
+    { gecko_evt_le_connection_closed_id,                             sizeof(struct gecko_msg_le_connection_closed_evt_t),         0 },
+    { gecko_rsp_gatt_discover_primary_services_id,                   sizeof(struct gecko_msg_gatt_discover_primary_services_rsp_t), 0 },
+    { gecko_evt_gatt_service_id,                                     sizeof(struct gecko_msg_gatt_service_evt_t),                 1 },
+    { gecko_rsp_gatt_server_read_attribute_type_id,                  sizeof(struct gecko_msg_gatt_server_read_attribute_type_rsp_t), 1 },
+    { gecko_evt_gatt_server_user_read_request_id,                    sizeof(struct gecko_msg_gatt_server_user_read_request_evt_t), 0 },
+    { gecko_rsp_endpoint_set_streaming_destination_id,               sizeof(struct gecko_msg_endpoint_set_streaming_destination_rsp_t), 0 },
+    { gecko_evt_endpoint_data_id,                                    sizeof(struct gecko_msg_endpoint_data_evt_t),                1 },
+    { gecko_rsp_hardware_configure_gpio_id,                          sizeof(struct gecko_msg_hardware_configure_gpio_rsp_t),      0 },
+    { gecko_evt_hardware_interrupt_id,                               sizeof(struct gecko_msg_hardware_interrupt_evt_t),           0 },
+    { gecko_rsp_flash_ps_erase_all_id,                               sizeof(struct gecko_msg_flash_ps_erase_all_rsp_t),           0 },
+    { gecko_rsp_test_dtm_rx_id,                                      sizeof(struct gecko_msg_test_dtm_rx_rsp_t),                  0 },
+    { gecko_rsp_sm_configure_id,                                     0,                                                           0 },
+    { gecko_evt_sm_passkey_request_id,                               sizeof(struct gecko_msg_sm_passkey_request_evt_t),           0 },
+    { gecko_rsp_dfu_flash_upload_id,                                 sizeof(struct gecko_msg_dfu_flash_upload_rsp_t),             0 },
+    { gecko_rsp_le_gap_discover_id,                                  sizeof(struct gecko_msg_le_gap_discover_rsp_t),              0 },
+    { gecko_evt_le_connection_parameters_id,                         sizeof(struct gecko_msg_le_connection_parameters_evt_t),     0 },
+    { gecko_rsp_gatt_discover_primary_services_by_uuid_id,           sizeof(struct gecko_msg_gatt_discover_primary_services_by_uuid_rsp_t), 0 },
+    { gecko_evt_gatt_characteristic_id,                              sizeof(struct gecko_msg_gatt_characteristic_evt_t),          1 },
+    { gecko_rsp_gatt_server_write_attribute_value_id,                sizeof(struct gecko_msg_gatt_server_write_attribute_value_rsp_t), 0 },
+    { gecko_evt_gatt_server_user_write_request_id,                   sizeof(struct gecko_msg_gatt_server_user_write_request_evt_t), 1 },
+    { gecko_rsp_endpoint_close_id,                                   sizeof(struct gecko_msg_endpoint_close_rsp_t),               0 },
+    { gecko_evt_endpoint_status_id,                                  sizeof(struct gecko_msg_endpoint_status_evt_t),              0 },
+    { gecko_rsp_hardware_write_gpio_id,                              sizeof(struct gecko_msg_hardware_write_gpio_rsp_t),          0 },
+    { gecko_rsp_flash_ps_save_id,                                    sizeof(struct gecko_msg_flash_ps_save_rsp_t),                0 },
+    { gecko_rsp_test_dtm_end_id,                                     sizeof(struct gecko_msg_test_dtm_end_rsp_t),                 0 },
+    { gecko_rsp_sm_store_bonding_configuration_id,                   sizeof(struct gecko_msg_sm_store_bonding_configuration_rsp_t), 0 },
+    { gecko_evt_sm_confirm_passkey_id,                               sizeof(struct gecko_msg_sm_confirm_passkey_evt_t),           0 },
+    { gecko_rsp_dfu_flash_upload_finish_id,                          sizeof(struct gecko_msg_dfu_flash_upload_finish_rsp_t),      0 },
+    { gecko_rsp_system_get_bt_address_id,                            sizeof(struct gecko_msg_system_get_bt_address_rsp_t),        0 },
+    { gecko_rsp_le_gap_end_procedure_id,                             sizeof(struct gecko_msg_le_gap_end_procedure_rsp_t),         0 },
+    { gecko_rsp_gatt_discover_characteristics_id,                    sizeof(struct gecko_msg_gatt_discover_characteristics_rsp_t), 0 },
+    { gecko_evt_gatt_descriptor_id,                                  sizeof(struct gecko_msg_gatt_descriptor_evt_t),              1 },
+    { gecko_rsp_gatt_server_send_user_read_response_id,              sizeof(struct gecko_msg_gatt_server_send_user_read_response_rsp_t), 0 },
+    { gecko_evt_gatt_server_characteristic_status_id,                sizeof(struct gecko_msg_gatt_server_characteristic_status_evt_t), 0 },
+    { gecko_rsp_endpoint_set_flags_id,                               sizeof(struct gecko_msg_endpoint_set_flags_rsp_t),           0 },
+    { gecko_evt_endpoint_closing_id,                                 sizeof(struct gecko_msg_endpoint_closing_evt_t),             0 },
+    { gecko_rsp_hardware_read_gpio_id,                               sizeof(struct gecko_msg_hardware_read_gpio_rsp_t),           0 },
+    { gecko_rsp_flash_ps_load_id,                                    sizeof(struct gecko_msg_flash_ps_load_rsp_t),                1 },
+    { gecko_evt_sm_bonded_id,                                        sizeof(struct gecko_msg_sm_bonded_evt_t),                    0 },
+    { gecko_rsp_le_gap_set_adv_parameters_id,                        sizeof(struct gecko_msg_le_gap_set_adv_parameters_rsp_t),    0 },
+    { gecko_rsp_gatt_discover_characteristics_by_uuid_id,            sizeof(struct gecko_msg_gatt_discover_characteristics_by_uuid_rsp_t), 0 },
+    { gecko_evt_gatt_characteristic_value_id,                        sizeof(struct gecko_msg_gatt_characteristic_value_evt_t),    1 },
+    { gecko_rsp_gatt_server_send_user_write_response_id,             sizeof(struct gecko_msg_gatt_server_send_user_write_response_rsp_t), 0 },
+    { gecko_rsp_endpoint_clr_flags_id,                               sizeof(struct gecko_msg_endpoint_clr_flags_rsp_t),           0 },
+    { gecko_rsp_hardware_read_adc_id,                                sizeof(struct gecko_msg_hardware_read_adc_rsp_t),            0 },
+    { gecko_rsp_flash_ps_erase_id,                                   sizeof(struct gecko_msg_flash_ps_erase_rsp_t),               0 },
+    { gecko_rsp_sm_increase_security_id,                             sizeof(struct gecko_msg_sm_increase_security_rsp_t),         0 },
+    { gecko_evt_sm_bonding_failed_id,                                sizeof(struct gecko_msg_sm_bonding_failed_evt_t),            0 },
+    { gecko_rsp_le_gap_set_conn_parameters_id,                       sizeof(struct gecko_msg_le_gap_set_conn_parameters_rsp_t),   0 },
+    { gecko_rsp_gatt_set_characteristic_notification_id,             sizeof(struct gecko_msg_gatt_set_characteristic_notification_rsp_t), 0 },
+    { gecko_evt_gatt_descriptor_value_id,                            sizeof(struct gecko_msg_gatt_descriptor_value_evt_t),        1 },
+    { gecko_rsp_gatt_server_send_characteristic_notification_id,     sizeof(struct gecko_msg_gatt_server_send_characteristic_notification_rsp_t), 0 },
+    { gecko_rsp_endpoint_read_counters_id,                           sizeof(struct gecko_msg_endpoint_read_counters_rsp_t),       0 },
+    { gecko_rsp_hardware_read_i2c_id,                                sizeof(struct gecko_msg_hardware_read_i2c_rsp_t),            1 },
+    { gecko_evt_sm_list_bonding_entry_id,                            sizeof(struct gecko_msg_sm_list_bonding_entry_evt_t),        0 },
+    { gecko_rsp_le_gap_set_scan_parameters_id,                       sizeof(struct gecko_msg_le_gap_set_scan_parameters_rsp_t),   0 },
+    { gecko_rsp_gatt_discover_descriptors_id,                        sizeof(struct gecko_msg_gatt_discover_descriptors_rsp_t),    0 },
+    { gecko_evt_gatt_procedure_completed_id,                         sizeof(struct gecko_msg_gatt_procedure_completed_evt_t),     0 },
+    { gecko_rsp_hardware_write_i2c_id,                               sizeof(struct gecko_msg_hardware_write_i2c_rsp_t),           0 },
+    { gecko_rsp_sm_delete_bonding_id,                                sizeof(struct gecko_msg_sm_delete_bonding_rsp_t),            0 },
+    { gecko_evt_sm_list_all_bondings_complete_id,                    0,                                                           0 },
+    { gecko_rsp_le_gap_set_adv_data_id,                              sizeof(struct gecko_msg_le_gap_set_adv_data_rsp_t),          0 },
+    { gecko_rsp_gatt_read_characteristic_value_id,                   sizeof(struct gecko_msg_gatt_read_characteristic_value_rsp_t), 0 },
+    { gecko_rsp_hardware_stop_i2c_id,                                sizeof(struct gecko_msg_hardware_stop_i2c_rsp_t),            0 },
+    { gecko_rsp_sm_delete_bondings_id,                               sizeof(struct gecko_msg_sm_delete_bondings_rsp_t),           0 },
+    { gecko_evt_sm_bonding_request_id,                               sizeof(struct gecko_msg_sm_bonding_request_evt_t),           0 },
+    { gecko_rsp_gatt_read_characteristic_value_by_uuid_id,           sizeof(struct gecko_msg_gatt_read_characteristic_value_by_uuid_rsp_t), 0 },
+    { gecko_rsp_sm_enter_passkey_id,                                 sizeof(struct gecko_msg_sm_enter_passkey_rsp_t),             0 },
+    { gecko_rsp_gatt_write_characteristic_value_id,                  sizeof(struct gecko_msg_gatt_write_characteristic_value_rsp_t), 0 },
+    { gecko_rsp_gatt_write_characteristic_value_without_response_id, sizeof(struct gecko_msg_gatt_write_characteristic_value_without_response_rsp_t), 0 },
+    { gecko_rsp_gatt_prepare_characteristic_value_write_id,          sizeof(struct gecko_msg_gatt_prepare_characteristic_value_write_rsp_t), 0 },
+    { gecko_rsp_sm_list_all_bondings_id,                             sizeof(struct gecko_msg_sm_list_all_bondings_rsp_t),         0 },
+    { gecko_rsp_gatt_execute_characteristic_value_write_id,          sizeof(struct gecko_msg_gatt_execute_characteristic_value_write_rsp_t), 0 },
+    { gecko_rsp_gatt_send_characteristic_confirmation_id,            sizeof(struct gecko_msg_gatt_send_characteristic_confirmation_rsp_t), 0 },
+    { gecko_rsp_gatt_read_descriptor_value_id,                       sizeof(struct gecko_msg_gatt_read_descriptor_value_rsp_t),   0 },
+    { gecko_rsp_gatt_write_descriptor_value_id,                      sizeof(struct gecko_msg_gatt_write_descriptor_value_rsp_t),  0 },
+    { gecko_rsp_gatt_find_included_services_id,                      sizeof(struct gecko_msg_gatt_find_included_services_rsp_t),  0 },
+    { gecko_rsp_gatt_read_multiple_characteristic_values_id,         sizeof(struct gecko_msg_gatt_read_multiple_characteristic_values_rsp_t), 0 },
+};
+
+#define GECKO_MSG_INFO_COUNT (sizeof(gecko_msg_infos) / sizeof(gecko_msg_infos[0]))
+
+void gecko_decoder_init(struct gecko_decoder_ctx* ctx, void (*on_frame)(struct gecko_cmd_packet* pck, void* user), void* user)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->on_frame = on_frame;
+    ctx->user = user;
+}
+
+static const struct gecko_msg_info* gecko_find_msg_info(uint32_t id)
+{//binary search the known messages
+    int lo = 0;
+    int hi = GECKO_MSG_INFO_COUNT - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (gecko_msg_infos[mid].id == id)
+            return &gecko_msg_infos[mid];
+        if (gecko_msg_infos[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+static int gecko_check_header(struct gecko_decoder_ctx* ctx)
+{//nonzero if the header is plausible
+    const struct gecko_msg_info* info = gecko_find_msg_info(BGLIB_MSG_ID(ctx->header));
+    uint16_t len = BGLIB_MSG_LEN(ctx->header);
+
+    if (!info)
+    {
+#ifdef BGLIB_ACCEPT_UNKNOWN_MSGS
+        return ctx->synced;//unknown message, only trusted while in sync
+#else
+        return 0;
+#endif
+    }
+
+    if (info->variable ? len < info->len : len != info->len)
+        return 0;
+
+    ctx->synced = 1;
+    return 1;
+}
+
+static int gecko_scan_header(const uint8_t* data, int len)
+{//index of the first byte that could start a header, len if none
+    int i = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    //check eight bytes at a time, bytes become zero where (b&0x78)==gecko_dev_type_gecko
+    for (; i + 8 <= len; i += 8)
     {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        w = (w & 0x7878787878787878ULL) ^ 0x2020202020202020ULL;
+        //every byte is below 0x80, so only a zero byte can borrow into its top bit
+        w = (w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL;
+        if (w)
+            return i + (__builtin_ctzll(w) >> 3);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if ((data[i] & 0x78) == gecko_dev_type_gecko)
+            return i;
+    }
+    return len;
+}
+
+static void gecko_reject_header(struct gecko_decoder_ctx* ctx)
+{//drop the first header byte and resume from the next candidate within the header
+    uint8_t* h = (uint8_t*)&ctx->header;
+    int skip = 1 + gecko_scan_header(&h[1], BGLIB_MSG_HEADER_LEN - 1);
+
+    ctx->discarded += skip;
+    ctx->synced = 0;
+    memmove(h, &h[skip], BGLIB_MSG_HEADER_LEN - skip);
+    ctx->pos = BGLIB_MSG_HEADER_LEN - skip;
+}
+
+static enum gecko_overflow_policy gecko_overflow = gecko_overflow_drop_newest;
+static uint32_t gecko_overflow_max_size;
+static struct gecko_queue_stats gecko_overflow_stats;
+static uint8_t gecko_arena_owned;//arena came from malloc
+static uint8_t* gecko_arena_retired;//grown out of but may hold the held event
+static uint32_t gecko_coalesce_msg[(BGLIB_MSG_HEADER_LEN + BGLIB_MSG_MAX_PAYLOAD + 3) / 4];//event waiting to be coalesced
+
+/** Registered event handler */
+struct gecko_handler_entry
+{
+    gecko_event_handler fn;
+    void* ctx;
+};
+
+//indexed by the class and method bytes of the header, slots without
+//their own handler hold a copy of the default so lookup is one load
+static struct gecko_handler_entry gecko_handlers[BGLIB_HANDLER_CLASSES][BGLIB_HANDLER_METHODS];
+static uint8_t gecko_handler_own[BGLIB_HANDLER_CLASSES][BGLIB_HANDLER_METHODS];
+static struct gecko_handler_entry gecko_default_handler;
+
+#ifdef BGLIB_THREAD
+//queue positions are handed between the decode thread and the reader
+#define GECKO_LOAD(v)       __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define GECKO_STORE(v, x)   __atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+
+static pthread_t gecko_thread;
+static pthread_mutex_t gecko_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gecko_thread_evt = PTHREAD_COND_INITIALIZER;//event queued
+static pthread_cond_t gecko_thread_space = PTHREAD_COND_INITIALIZER;//event released
+static pthread_cond_t gecko_thread_rsp = PTHREAD_COND_INITIALIZER;//response received
+static uint8_t gecko_thread_started;
+static uint32_t gecko_thread_running;
+static uint32_t gecko_thread_evt_waiting;
+static uint32_t gecko_thread_space_waiting;
+static uint32_t gecko_thread_cmd_waiting;
+static uint32_t gecko_thread_rsp_seq;
+
+static void gecko_thread_wake(uint32_t* waiting, pthread_cond_t* cond)
+{//the lock is only taken when someone is asleep
+    if (!GECKO_LOAD(*waiting))
+        return;
+    pthread_mutex_lock(&gecko_thread_lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&gecko_thread_lock);
+}
+#else
+#define GECKO_LOAD(v)       (v)
+#define GECKO_STORE(v, x)   ((v) = (x))
+#endif
+
+void gecko_set_overflow_policy(enum gecko_overflow_policy policy, uint32_t max_size)
+{
+    gecko_overflow = policy;
+    gecko_overflow_max_size = max_size;
+}
+
+void gecko_get_queue_stats(struct gecko_queue_stats* stats)
+{
+    *stats = gecko_overflow_stats;
+}
+
+int gecko_register_handler(uint32_t id, gecko_event_handler fn, void* ctx)
+{
+    uint32_t cls = (id >> 16) & 0xff;
+    uint32_t method = id >> 24;
+
+    if ((id & 0xf8) != (gecko_dev_type_gecko | gecko_msg_type_evt))
+        return -1;
+    if (cls >= BGLIB_HANDLER_CLASSES || method >= BGLIB_HANDLER_METHODS)
+        return -1;
+
+    gecko_handler_own[cls][method] = fn != NULL;
+    gecko_handlers[cls][method] = gecko_default_handler;
+    if (fn)
+    {
+        gecko_handlers[cls][method].fn = fn;
+        gecko_handlers[cls][method].ctx = ctx;
+    }
+    return 0;
+}
+
+void gecko_register_default_handler(gecko_event_handler fn, void* ctx)
+{
+    int cls;
+    int method;
+
+    gecko_default_handler.fn = fn;
+    gecko_default_handler.ctx = ctx;
+    for (cls = 0; cls < BGLIB_HANDLER_CLASSES; cls++)
+        for (method = 0; method < BGLIB_HANDLER_METHODS; method++)
+            if (!gecko_handler_own[cls][method])
+                gecko_handlers[cls][method] = gecko_default_handler;
+}
+
+static const struct gecko_handler_entry* gecko_find_handler(uint32_t header)
+{//handler for a queued event, fn is NULL if it goes to the application
+    uint32_t cls = (header >> 16) & 0xff;
+    uint32_t method = header >> 24;
+
+    if (cls >= BGLIB_HANDLER_CLASSES || method >= BGLIB_HANDLER_METHODS)
+        return &gecko_default_handler;
+    return &gecko_handlers[cls][method];
+}
+
+uint32_t gecko_set_queue(void* storage, uint32_t size)
+{
+    //keep only the highest bit
+    while (size & (size - 1))
+        size &= size - 1;
+    if (size < sizeof(struct gecko_cmd_packet))
         return 0;
+
+    if (gecko_arena_owned)
+        free(gecko_arena);
+    free(gecko_arena_retired);
+    gecko_arena_owned = 0;
+    gecko_arena_retired = NULL;
+
+    gecko_arena = (uint8_t*)storage;
+    gecko_arena_mask = size - 1;
+    gecko_arena_w = 0;
+    gecko_arena_r = 0;
+    gecko_arena_held = 0;
+    gecko_arena_high = 0;
+    return size;
+}
+
+uint32_t gecko_queue_high_water(void)
+{
+    return gecko_arena_high;
+}
+
+static uint32_t gecko_arena_entry_size(uint32_t header)
+{//bytes taken by a frame, kept 4 byte aligned so headers can be read in place
+    return (BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(header) + 3) & ~3u;
+}
+
+static struct gecko_cmd_packet* gecko_arena_claim(uint32_t header)
+{//reserve contiguous room for a frame, NULL if there is none
+    uint32_t need = gecko_arena_entry_size(header);
+    uint32_t offset = gecko_arena_w & gecko_arena_mask;
+    uint32_t pad = 0;
+
+    //frames never wrap, skip the rest of the arena if this one would
+    if (need > gecko_arena_mask + 1 - offset)
+        pad = gecko_arena_mask + 1 - offset;
+    if (pad + need > gecko_arena_mask + 1 - (gecko_arena_w - GECKO_LOAD(gecko_arena_r)))
+        return NULL;
+    if (pad)
+    {
+        *(uint32_t*)&gecko_arena[offset] = 0;//wrap marker, never a valid header
+        GECKO_STORE(gecko_arena_w, gecko_arena_w + pad);
+        offset = 0;
     }
-    ret = bglib_input(BGLIB_MSG_HEADER_LEN-1, &((uint8_t*)&header)[1]);
-    if (ret < 0)
+    return (struct gecko_cmd_packet*)&gecko_arena[offset];
+}
+
+static void gecko_arena_commit(struct gecko_cmd_packet* pck)
+{//publish a complete frame
+    uint32_t used;
+
+    GECKO_STORE(gecko_arena_w, gecko_arena_w + gecko_arena_entry_size(pck->header));
+    used = gecko_arena_w - GECKO_LOAD(gecko_arena_r);
+    if (used > gecko_arena_high)
+        gecko_arena_high = used;
+#ifdef BGLIB_THREAD
+    gecko_thread_wake(&gecko_thread_evt_waiting, &gecko_thread_evt);
+#endif
+}
+
+static uint32_t gecko_arena_next(void)
+{//position of the oldest event once the held one is released
+    uint32_t r = gecko_arena_r + gecko_arena_held;
+    uint32_t offset = r & gecko_arena_mask;
+
+    if (r != GECKO_LOAD(gecko_arena_w) && *(uint32_t*)&gecko_arena[offset] == 0)
+        r += gecko_arena_mask + 1 - offset;//skip the wrap marker
+    return r;
+}
+
+static uint32_t gecko_arena_copy(uint8_t* dst, uint32_t from)
+{//copy events from position from onwards to the start of dst, returns bytes copied
+    uint32_t size = gecko_arena_mask + 1;
+    uint32_t n = 0;
+
+    while (from != gecko_arena_w)
     {
+        uint32_t offset = from & gecko_arena_mask;
+        uint32_t header = *(uint32_t*)&gecko_arena[offset];
+        uint32_t len;
+
+        if (header == 0)
+        {//wrap marker
+            from += size - offset;
+            continue;
+        }
+        len = gecko_arena_entry_size(header);
+        memcpy(&dst[n], &gecko_arena[offset], len);
+        n += len;
+        from += len;
+    }
+    return n;
+}
+
+static int gecko_arena_drop_oldest(void)
+{//drop the oldest event that is not held, nonzero if there was one
+    uint32_t size = gecko_arena_mask + 1;
+    uint32_t from = gecko_arena_next();
+    uint32_t to = from;
+
+    if (from == gecko_arena_w)
         return 0;
+
+    from += gecko_arena_entry_size(*(uint32_t*)&gecko_arena[from & gecko_arena_mask]);
+    gecko_overflow_stats.dropped_oldest++;
+    if (!gecko_arena_held)
+    {
+        gecko_arena_r = from;
+        return 1;
     }
 
-    msg_length = BGLIB_MSG_LEN(header);
+    //the held event sits before it, close the gap by moving the newer events back
+    while (from != gecko_arena_w)
+    {
+        uint32_t offset = from & gecko_arena_mask;
+        uint32_t header = *(uint32_t*)&gecko_arena[offset];
+        uint32_t len;
+
+        if (header == 0)
+        {//wrap marker
+            from += size - offset;
+            continue;
+        }
+        len = gecko_arena_entry_size(header);
+        if (len > size - (to & gecko_arena_mask))
+        {
+            *(uint32_t*)&gecko_arena[to & gecko_arena_mask] = 0;
+            to += size - (to & gecko_arena_mask);
+        }
+        memmove(&gecko_arena[to & gecko_arena_mask], &gecko_arena[offset], len);
+        to += len;
+        from += len;
+    }
+    gecko_arena_w = to;
+    return 1;
+}
+
+static struct gecko_cmd_packet* gecko_arena_coalesce(uint32_t header)
+{//find the newest queued event with the same header to overwrite, so order moves as little as possible
+    struct gecko_cmd_packet* found = NULL;
+    uint32_t size = gecko_arena_mask + 1;
+    uint32_t pos = gecko_arena_next();
+
+    while (pos != gecko_arena_w)
+    {
+        uint32_t offset = pos & gecko_arena_mask;
+        uint32_t queued = *(uint32_t*)&gecko_arena[offset];
+
+        if (queued == 0)
+        {//wrap marker
+            pos += size - offset;
+            continue;
+        }
+        if (queued == header)
+            found = (struct gecko_cmd_packet*)&gecko_arena[offset];
+        pos += gecko_arena_entry_size(queued);
+    }
+    return found;
+}
+
+static int gecko_arena_grow(uint32_t header)
+{//move the queue to larger memory, nonzero on success
+    uint32_t used = gecko_arena_w - gecko_arena_r;
+    uint32_t size = gecko_arena_mask + 1;
+    uint8_t* arena;
+
+    while (size - used < gecko_arena_entry_size(header))
+        size *= 2;
+    if (gecko_overflow_max_size && size > gecko_overflow_max_size)
+        return 0;
+    arena = (uint8_t*)malloc(size);
+    if (!arena)
+        return 0;
 
+    //queued events, held one included, are laid out again from the start
+    used = gecko_arena_copy(arena, gecko_arena_r);
+
+    //the held event must stay where the application was given it
+    if (gecko_arena_held && !gecko_arena_retired && gecko_arena_owned)
+        gecko_arena_retired = gecko_arena;
+    else if (gecko_arena_owned)
+        free(gecko_arena);
+
+    gecko_arena = arena;
+    gecko_arena_owned = 1;
+    gecko_arena_mask = size - 1;
+    gecko_arena_r = 0;
+    gecko_arena_w = used;
+    gecko_overflow_stats.grown++;
+    return 1;
+}
+
+#ifdef BGLIB_THREAD
+static struct gecko_cmd_packet* gecko_thread_claim(uint32_t header)
+{//queue is full while the application reads it, so queued events are left alone
+    struct gecko_cmd_packet* pck = NULL;
+
+    if (gecko_overflow == gecko_overflow_block)
+    {
+        //a response may be queued behind this event, so never wait while a command does
+        pthread_mutex_lock(&gecko_thread_lock);
+        GECKO_STORE(gecko_thread_space_waiting, 1);
+        while (!(pck = gecko_arena_claim(header)) && GECKO_LOAD(gecko_thread_running) && !gecko_thread_cmd_waiting)
+            pthread_cond_wait(&gecko_thread_space, &gecko_thread_lock);
+        GECKO_STORE(gecko_thread_space_waiting, 0);
+        pthread_mutex_unlock(&gecko_thread_lock);
+    }
+    if (!pck)
+        gecko_overflow_stats.dropped_newest++;
+    return pck;
+}
+#endif
+
+static struct gecko_cmd_packet* gecko_claim_event(struct gecko_decoder_ctx* ctx, uint32_t header)
+{//find room for an event, applying the overflow policy if the queue is full
+    struct gecko_cmd_packet* pck = gecko_arena_claim(header);
+
+    if (pck)
+        return pck;
+#ifdef BGLIB_THREAD
+    if (GECKO_LOAD(gecko_thread_running))
+        return gecko_thread_claim(header);
+#endif
+
+    switch (gecko_overflow)
+    {
+    case gecko_overflow_drop_oldest:
+        while (!pck && gecko_arena_drop_oldest())
+            pck = gecko_arena_claim(header);
+        break;
+    case gecko_overflow_coalesce:
+        //queued events may be read before this one is complete, so decode it aside
+        ctx->coalesce = 1;
+        return (struct gecko_cmd_packet*)gecko_coalesce_msg;
+    case gecko_overflow_grow:
+        if (gecko_arena_grow(header))
+            pck = gecko_arena_claim(header);
+        break;
+    default:
+        break;
+    }
+    if (!pck)
+        gecko_overflow_stats.dropped_newest++;
+    return pck;
+}
+
+static struct gecko_cmd_packet* gecko_claim_packet(struct gecko_decoder_ctx* ctx, uint32_t header)
+{//find where a frame with this header is stored, NULL to skip it
+    ctx->coalesce = 0;
     if ((header & 0xf8) == (gecko_dev_type_gecko | gecko_msg_type_evt))
     {
         //received event
-        if ((gecko_queue_w + 1) % BGLIB_QUEUE_LEN == gecko_queue_r)
-            return 0;//NO ROOM IN QUEUE
-
-        pck=&gecko_queue[gecko_queue_w];
-        gecko_queue_w = (gecko_queue_w + 1) % BGLIB_QUEUE_LEN;
+        return gecko_claim_event(ctx, header);
     }
     else if ((header & 0xf8) == gecko_dev_type_gecko)
     {//response
-        pck = gecko_rsp_msg;
+        return gecko_rsp_msg;
     }
-    else
+    //fail
+    return NULL;
+}
+
+static struct gecko_cmd_packet* gecko_coalesce_event(uint32_t header)
+{//queue the event held aside, returns where it went or NULL if dropped
+    struct gecko_cmd_packet* pck = gecko_arena_claim(header);
+    uint32_t len = BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(header);
+
+    if (pck)
+    {//room was made while it was received
+        memcpy(pck, gecko_coalesce_msg, len);
+        gecko_arena_commit(pck);
+        return pck;
+    }
+    pck = gecko_arena_coalesce(header);
+    if (pck)
     {
-        //fail
-        return 0;
+        memcpy(pck, gecko_coalesce_msg, len);
+        gecko_overflow_stats.coalesced++;
+        return pck;
     }
-    pck->header = header;
-    payload = (uint8_t*)&pck->data.payload;
-    /**
-    * Read the payload data if required and store it after the header.
-    */
-    if (msg_length)
+    gecko_overflow_stats.dropped_newest++;
+    return NULL;
+}
+
+static struct gecko_cmd_packet* gecko_complete_packet(struct gecko_decoder_ctx* ctx)
+{//frame fully received, returns where it was stored
+    struct gecko_cmd_packet* pck = ctx->pck;
+
+    ctx->pos = 0;
+    if (!pck)
+        return NULL;
+
+    //only publish queued events once complete
+    if (ctx->coalesce)
     {
-        ret = bglib_input(msg_length, payload);
-        if (ret < 0)
+        pck = gecko_coalesce_event(ctx->header);
+        if (!pck)
+            return NULL;
+    }
+    else if (pck != gecko_rsp_msg)
+        gecko_arena_commit(pck);
+
+    ctx->last = pck;
+    if (ctx->on_frame)
+        ctx->on_frame(pck, ctx->user);
+    return pck;
+}
+
+int gecko_feed(struct gecko_decoder_ctx* ctx, const uint8_t* data, int len)
+{
+    int frames = 0;
+    int n;
+
+    while (len > 0)
+    {
+        if (ctx->pos < BGLIB_MSG_HEADER_LEN)
+        {
+            //sync to header byte
+            if (ctx->pos == 0)
+            {
+                n = gecko_scan_header(data, len);
+                if (n)
+                {
+                    ctx->discarded += n;
+                    ctx->synced = 0;
+                    data += n;
+                    len -= n;
+                    continue;
+                }
+            }
+            //collect as much of the header as is here
+            n = BGLIB_MSG_HEADER_LEN - ctx->pos;
+            if (n > len)
+                n = len;
+            memcpy(&((uint8_t*)&ctx->header)[ctx->pos], data, n);
+            ctx->pos += n;
+            data += n;
+            len -= n;
+            if (ctx->pos < BGLIB_MSG_HEADER_LEN)
+                break;
+
+            //a corrupt length would swallow the frames behind it
+            if (!gecko_check_header(ctx))
+            {
+                gecko_reject_header(ctx);
+                continue;
+            }
+            ctx->len = BGLIB_MSG_LEN(ctx->header);
+            ctx->pck = gecko_claim_packet(ctx, ctx->header);
+            if (ctx->pck)
+                ctx->pck->header = ctx->header;
+        }
+        else
+        {
+            //copy payload straight into its destination
+            n = BGLIB_MSG_HEADER_LEN + ctx->len - ctx->pos;
+            if (n > len)
+                n = len;
+            if (ctx->pck)
+                memcpy((uint8_t*)ctx->pck + ctx->pos, data, n);
+            ctx->pos += n;
+            data += n;
+            len -= n;
+        }
+        if (ctx->pos == BGLIB_MSG_HEADER_LEN + ctx->len)
+        {
+            if (gecko_complete_packet(ctx))
+                frames++;
+        }
+    }
+    return frames;
+}
+
+static int gecko_read_field(struct gecko_decoder_ctx* ctx)
+{//read exactly the rest of the current field, so nothing is read ahead
+    uint8_t  buf[BGLIB_MSG_MAX_PAYLOAD];
+    int      need;
+
+    if (ctx->pos == 0)
+        need = 1;
+    else if (ctx->pos < BGLIB_MSG_HEADER_LEN)
+        need = BGLIB_MSG_HEADER_LEN - ctx->pos;
+    else
+        need = BGLIB_MSG_HEADER_LEN + ctx->len - ctx->pos;
+
+    if (bglib_input(need, buf) < 0)
+        return -1;
+    gecko_feed(ctx, buf, need);
+    return 0;
+}
+
+static int gecko_read_available(struct gecko_decoder_ctx* ctx)
+{//read only what bglib_peek reports, so a partial frame does not block
+    uint8_t  buf[BGLIB_MSG_MAX_PAYLOAD];
+    int      n = bglib_peek();
+
+    if (n <= 0)
+        return 0;
+    if (n > (int)sizeof(buf))
+        n = sizeof(buf);
+    if (bglib_input(n, buf) < 0)
+        return -1;
+    gecko_feed(ctx, buf, n);
+    return n;
+}
+
+struct gecko_cmd_packet* gecko_wait_message(void)
+{//wait for event from system
+    struct gecko_decoder_ctx* ctx = gecko_decoder;
+
+    ctx->last = NULL;
+    while (!ctx->last)
+    {
+        if (gecko_read_field(ctx) < 0)
+        {
+            return 0;
+        }
+        //not a header byte, or a frame that had to be skipped
+        if (ctx->pos == 0 && !ctx->last)
         {
             return 0;
         }
     }
-    return pck;
+    return ctx->last;
 }
 
 
 int gecko_event_pending(void)
 {
-    if(gecko_queue_w != gecko_queue_r)
+    if(gecko_arena_next() != GECKO_LOAD(gecko_arena_w))
     {//event is waiting in queue
         return 1;
     }
 
+#ifdef BGLIB_THREAD
+    //the decode thread owns the device
+    if (GECKO_LOAD(gecko_thread_running))
+        return 0;
+#endif
+
     //something in uart waiting to be read
 	if (bglib_peek && bglib_peek())
         return 1;
@@ -70,21 +762,162 @@ int gecko_event_pending(void)
     return 0;
 }
 
+int gecko_get_pollable_fd(void)
+{
+    if (bglib_pollfd)
+        return bglib_pollfd();
+
+    return -1;
+}
+
+#ifdef BGLIB_THREAD
+static void* gecko_thread_main(void* arg)
+{//decode frames as they arrive, until stopped or the device fails
+    struct gecko_decoder_ctx* ctx = gecko_decoder;
+    int fd = bglib_pollfd ? bglib_pollfd() : -1;
+    struct pollfd pfd;
+
+    while (GECKO_LOAD(gecko_thread_running))
+    {
+        //sleep with a timeout when possible so a stop request is noticed
+        if (fd >= 0 && bglib_peek && !bglib_peek())
+        {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, BGLIB_THREAD_POLL_MS);
+            continue;
+        }
+        ctx->last = NULL;
+        if (gecko_read_field(ctx) < 0)
+            break;
+        if (ctx->last == gecko_rsp_msg)
+        {//hand the response to the command caller
+            pthread_mutex_lock(&gecko_thread_lock);
+            gecko_thread_rsp_seq++;
+            pthread_cond_broadcast(&gecko_thread_rsp);
+            pthread_mutex_unlock(&gecko_thread_lock);
+        }
+    }
+
+    //nothing more will arrive, wake everyone so they stop waiting on the thread
+    pthread_mutex_lock(&gecko_thread_lock);
+    GECKO_STORE(gecko_thread_running, 0);
+    pthread_cond_broadcast(&gecko_thread_evt);
+    pthread_cond_broadcast(&gecko_thread_space);
+    pthread_cond_broadcast(&gecko_thread_rsp);
+    pthread_mutex_unlock(&gecko_thread_lock);
+    return NULL;
+}
+
+int gecko_start_thread(void)
+{
+    gecko_stop_thread();
+
+    GECKO_STORE(gecko_thread_running, 1);
+    if (pthread_create(&gecko_thread, NULL, gecko_thread_main, NULL) != 0)
+    {
+        GECKO_STORE(gecko_thread_running, 0);
+        return -1;
+    }
+    gecko_thread_started = 1;
+    return 0;
+}
+
+void gecko_stop_thread(void)
+{
+    if (!gecko_thread_started)
+        return;
+
+    pthread_mutex_lock(&gecko_thread_lock);
+    GECKO_STORE(gecko_thread_running, 0);
+    pthread_cond_broadcast(&gecko_thread_space);
+    pthread_mutex_unlock(&gecko_thread_lock);
+
+    pthread_join(gecko_thread, NULL);
+    gecko_thread_started = 0;
+}
+
+static void gecko_thread_wait_event(void)
+{//sleep until the decode thread queues an event
+    pthread_mutex_lock(&gecko_thread_lock);
+    GECKO_STORE(gecko_thread_evt_waiting, 1);
+    while (gecko_arena_next() == GECKO_LOAD(gecko_arena_w) && GECKO_LOAD(gecko_thread_running))
+        pthread_cond_wait(&gecko_thread_evt, &gecko_thread_lock);
+    GECKO_STORE(gecko_thread_evt_waiting, 0);
+    pthread_mutex_unlock(&gecko_thread_lock);
+}
+
+static int gecko_thread_command(void)
+{//send the command and sleep until the decode thread delivers the response, nonzero if it stopped first
+    uint32_t seq;
+    int stopped;
+
+    pthread_mutex_lock(&gecko_thread_lock);
+    seq = gecko_thread_rsp_seq;
+    gecko_thread_cmd_waiting = 1;
+    pthread_cond_broadcast(&gecko_thread_space);
+    pthread_mutex_unlock(&gecko_thread_lock);
+
+    bglib_output(BGLIB_MSG_HEADER_LEN+BGLIB_MSG_LEN(gecko_cmd_msg->header), (uint8_t*)gecko_cmd_msg);
+
+    pthread_mutex_lock(&gecko_thread_lock);
+    while (gecko_thread_rsp_seq == seq && GECKO_LOAD(gecko_thread_running))
+        pthread_cond_wait(&gecko_thread_rsp, &gecko_thread_lock);
+    stopped = gecko_thread_rsp_seq == seq;
+    gecko_thread_cmd_waiting = 0;
+    pthread_mutex_unlock(&gecko_thread_lock);
+    return stopped;
+}
+#endif
+
 struct gecko_cmd_packet* gecko_get_event(int block)
 {
     struct gecko_cmd_packet* p;
+    const struct gecko_handler_entry* h;
 
     while (1)
     {
-        if (gecko_queue_w != gecko_queue_r)
+        //the previous event is no longer in use
+        GECKO_STORE(gecko_arena_r, gecko_arena_next());
+        gecko_arena_held = 0;
+#ifdef BGLIB_THREAD
+        gecko_thread_wake(&gecko_thread_space_waiting, &gecko_thread_space);
+#endif
+        if (gecko_arena_retired)
         {
-            p = &gecko_queue[gecko_queue_r];
-            gecko_queue_r = (gecko_queue_r + 1) % BGLIB_QUEUE_LEN;
+            free(gecko_arena_retired);
+            gecko_arena_retired = NULL;
+        }
+        if (GECKO_LOAD(gecko_arena_w) != gecko_arena_r)
+        {
+            p = (struct gecko_cmd_packet*)&gecko_arena[gecko_arena_r & gecko_arena_mask];
+            gecko_arena_held = gecko_arena_entry_size(p->header);
+
+            //held until the next pass, so the handler may send commands
+            h = gecko_find_handler(p->header);
+            if (h->fn)
+            {
+                h->fn(p, h->ctx);
+                continue;
+            }
             return p;
         }
-        //if not blocking and nothing in uart -> out
-        if(!block && bglib_peek && bglib_peek()==0)
-            return NULL;
+#ifdef BGLIB_THREAD
+        if (GECKO_LOAD(gecko_thread_running))
+        {
+            if (!block)
+                return NULL;
+            gecko_thread_wait_event();
+            continue;
+        }
+#endif
+        //if not blocking, decode only what has arrived and stop once uart is empty
+        if(!block && bglib_peek)
+        {
+            if (gecko_read_available(gecko_decoder) <= 0)
+                return NULL;
+            continue;
+        }
 
         //read more messages from device
         gecko_wait_message();
@@ -114,6 +947,14 @@ struct gecko_cmd_packet* gecko_wait_response(void)
 
 void gecko_handle_command(uint32_t hdr, void* data)
 {
+#ifdef BGLIB_THREAD
+    if (GECKO_LOAD(gecko_thread_running))
+    {//the decode thread reads the response
+        if (gecko_thread_command())
+            gecko_wait_response();//it stopped before the response came
+        return;
+    }
+#endif
     //packet in gecko_cmd_msg is waiting for output
     bglib_output(BGLIB_MSG_HEADER_LEN+BGLIB_MSG_LEN(gecko_cmd_msg->header), (uint8_t*)gecko_cmd_msg);
     gecko_wait_response();
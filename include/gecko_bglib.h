@@ -17,8 +17,42 @@
 *  any events are received during response waiting, they are queued and 
 *  delivered next time gecko_wait_event is called.
 *
-*  Queue length is controlled by defining macro "BGLIB_QUEUE_LEN", default is 30.
-*  Queue length depends on use cases and allowed host memory usage.
+*  Events are queued at their received length in a byte arena, so small
+*  events take a few bytes. An event returned by gecko_wait_event or
+*  gecko_peek_event stays valid until the next call to either.
+*
+*  Queue size is controlled by defining macro "BGLIB_QUEUE_LEN", default is 30.
+*  The arena holds at least BGLIB_QUEUE_LEN full size events.
+*  Queue size depends on use cases and allowed host memory usage.
+*  It can also be chosen at run time by giving the library other storage,
+*  before any data is received:
+*      static uint32_t my_queue[16384];
+*      gecko_set_queue(my_queue, sizeof(my_queue));
+*  gecko_queue_high_water() reports the most the queue has held, to help
+*  sizing it.
+*
+*  When an event arrives and the queue is full, what happens is chosen with
+*  gecko_set_overflow_policy, the default is to drop the new event. The
+*  event held by the application is never dropped or moved. Counts of
+*  each action are kept, see gecko_get_queue_stats.
+*  gecko_overflow_coalesce overwrites the newest queued event with the same
+*  ID and length, so the new event takes that event's place: it is read
+*  before any events with other IDs that were queued after it.
+*
+*  Background decoding, build with BGLIB_THREAD defined (cmake -DBGLIB_THREAD=ON)
+*  and link pthread:
+*      gecko_start_thread();
+*  A thread then reads and decodes frames as they arrive, so the device is
+*  drained even while the application is busy handling an event.
+*  gecko_wait_event sleeps until an event is queued, gecko_peek_event only
+*  looks at the queue and commands sleep until the thread delivers their
+*  response. One thread may read events and one may send commands, and
+*  on_frame is called from the decode thread. Policies that rewrite queued
+*  events act as drop_newest while it runs, gecko_overflow_block makes it
+*  wait for room instead, except while a command waits for its response.
+*  gecko_stop_thread returns once bglib_input does,
+*  with a pollable fd the thread checks for a stop every
+*  BGLIB_THREAD_POLL_MS.
 *
 *  BGLIB usage:
 *      Define library, it must be defined globally:
@@ -36,6 +70,31 @@
 *      Initialize library,and provide output and input function:
 *          BGLIB_INITIALIZE(my_output,my_input);
 *
+*      For nonblocking use also provide a peek function, prototype is:
+*          int my_peek(void);
+*          Function returns how many bytes can be read from device without
+*          blocking. gecko_peek_event reads only that much, so a frame that
+*          is still arriving does not block it.
+*
+*          BGLIB_INITIALIZE_NONBLOCK(my_output,my_input,my_peek);
+*
+*      To drive the library from an external poll/epoll loop also provide
+*      a function returning a file descriptor that becomes readable when
+*      data arrives, prototype is:
+*          int my_fd(void);
+*
+*          BGLIB_INITIALIZE_POLLABLE(my_output,my_input,my_peek,my_fd);
+*
+*      Wait for gecko_get_pollable_fd() to become readable, then call
+*      gecko_peek_event until it returns NULL.
+*
+*      Alternatively read from the device yourself and push the data into
+*      the library, frames are decoded as they complete and chunks may be
+*      split anywhere:
+*          n = read(fd, buf, sizeof(buf));
+*          gecko_feed(gecko_decoder, buf, n);
+*          while ((p = gecko_peek_event()) != NULL) { ... }
+*
 *
 *  Receiving event:
 *   Events are received by gecko_wait_event-function.
@@ -57,6 +116,26 @@
 *           c=evt->evt_gatt_server_characteristic_status.connection;//accesses connection field of event data
 *       }
 *
+*   Instead of switching on the ID, handlers can be registered per event:
+*       static void on_status(struct gecko_cmd_packet* evt, void* ctx) { ... }
+*
+*       gecko_register_handler(gecko_evt_gatt_server_characteristic_status_id, on_status, NULL);
+*
+*   Handlers are not called by the decoder as frames arrive, but from
+*   gecko_wait_event and gecko_peek_event on the application's thread, so
+*   nothing is dispatched unless the application keeps calling one of them.
+*   This lets handlers send commands, which the decoder could not wait for,
+*   and keeps them off the decode thread. They only return events that
+*   have no handler.
+*   Once a default handler is set every event goes to a handler:
+*   gecko_peek_event then returns NULL once the queue and the device are
+*   empty, and gecko_wait_event never returns, so call gecko_peek_event
+*   from a poll loop instead. Handlers may send commands but must not read
+*   events.
+*   The table costs about the same per event as a switch on the ID (see
+*   work/bench/dispatch_bench.c), it is there so separate modules can each
+*   claim their events at run time, not for speed.
+*
 *  Sending commands:
 *   BGAPI-commands can be sent by calling helper functions, that then build bgapi-message and call output-function.
 *   Function then waits for response and return pointer to that message.
@@ -83,43 +162,219 @@
 #define BGLIB_QUEUE_LEN 30
 #endif
 
+#ifndef BGLIB_THREAD_POLL_MS
+#define BGLIB_THREAD_POLL_MS 100
+#endif
+
+/** Event handler table size, covering class and method IDs below these */
+#ifndef BGLIB_HANDLER_CLASSES
+#define BGLIB_HANDLER_CLASSES 32
+#endif
+#ifndef BGLIB_HANDLER_METHODS
+#define BGLIB_HANDLER_METHODS 32
+#endif
+
+/** Largest payload a header can describe */
+#define BGLIB_MSG_MAX_PAYLOAD 2047
+
+/** Round up to a power of two at compile time */
+#define BGLIB_POW2_SMEAR(X,S) ((X)|((X)>>(S)))
+#define BGLIB_POW2_CEIL(X) (BGLIB_POW2_SMEAR(BGLIB_POW2_SMEAR(BGLIB_POW2_SMEAR(BGLIB_POW2_SMEAR(BGLIB_POW2_SMEAR((X)-1,1),2),4),8),16)+1)
+
+/** Default event arena size in bytes, a power of two */
+#define BGLIB_ARENA_SIZE BGLIB_POW2_CEIL(BGLIB_QUEUE_LEN*sizeof(struct gecko_cmd_packet))
+
+/**
+ * Frame decoder state, see gecko_feed.
+ * Frames that do not fit in their destination are skipped.
+ * Headers are checked against the known messages and their lengths,
+ * so a corrupt header is discarded instead of swallowing the frames
+ * behind it. Messages unknown to this host_gecko.h are discarded too,
+ * unless BGLIB_ACCEPT_UNKNOWN_MSGS is defined, in which case they are
+ * accepted while in sync: after a known frame and before any byte
+ * had to be discarded.
+ */
+struct gecko_decoder_ctx
+{
+    uint32_t header;                 /* header of the frame being received */
+    uint16_t pos;                    /* bytes of the frame received so far, 0 between frames */
+    uint16_t len;                    /* payload length of the frame being received */
+    struct gecko_cmd_packet* pck;    /* destination of the frame, NULL if skipped */
+    struct gecko_cmd_packet* last;   /* last frame completed */
+    uint8_t  coalesce;               /* frame is held aside to replace a queued event */
+    uint8_t  synced;                 /* a known frame has been seen since sync was lost */
+    uint32_t discarded;              /* bytes dropped while searching for a header */
+    void (*on_frame)(struct gecko_cmd_packet* pck, void* user); /* optional, called for each frame */
+    void* user;                      /* passed to on_frame */
+};
+
 
 
 #define BGLIB_DEFINE() \
 struct gecko_cmd_packet _gecko_cmd_msg;\
-struct gecko_cmd_packet _gecko_rsp_msg;\
+uint32_t _gecko_rsp_msg[(BGLIB_MSG_HEADER_LEN+BGLIB_MSG_MAX_PAYLOAD+3)/4];\
 struct gecko_cmd_packet *gecko_cmd_msg=&_gecko_cmd_msg;\
-struct gecko_cmd_packet *gecko_rsp_msg=&_gecko_rsp_msg;\
+struct gecko_cmd_packet *gecko_rsp_msg=(struct gecko_cmd_packet*)_gecko_rsp_msg;\
 struct gecko_cmd_packet *gecko_evt_msg;\
 void (*bglib_output)(uint16 len1,uint8* data1);\
 int  (*bglib_input)(uint16 len1, uint8* data1);\
 int  (*bglib_peek)(void);\
-struct gecko_cmd_packet gecko_queue[BGLIB_QUEUE_LEN];\
-int    gecko_queue_w=0;\
-int    gecko_queue_r=0;
+int  (*bglib_pollfd)(void);\
+uint32_t _gecko_arena[BGLIB_ARENA_SIZE/4];\
+uint8_t  *gecko_arena=(uint8_t*)_gecko_arena;\
+uint32_t gecko_arena_mask=BGLIB_ARENA_SIZE-1;\
+uint32_t gecko_arena_w=0;\
+uint32_t gecko_arena_r=0;\
+uint32_t gecko_arena_held=0;\
+uint32_t gecko_arena_high=0;\
+struct gecko_decoder_ctx _gecko_decoder;\
+struct gecko_decoder_ctx *gecko_decoder=&_gecko_decoder;
 
-extern struct gecko_cmd_packet gecko_queue[BGLIB_QUEUE_LEN]; 
-extern int    gecko_queue_w; 
-extern int    gecko_queue_r; 
+extern uint8_t  *gecko_arena;        /* queued events, each stored at its length rounded up to 4 bytes */
+extern uint32_t gecko_arena_mask;    /* arena size in bytes minus one, the size is a power of two */
+extern uint32_t gecko_arena_w;       /* bytes ever written, masked to find where the next event goes */
+extern uint32_t gecko_arena_r;       /* bytes ever released, masked to find the oldest event */
+extern uint32_t gecko_arena_held;    /* size of the event last returned, released on the next call */
+extern uint32_t gecko_arena_high;    /* most bytes the arena has held */
+extern struct gecko_decoder_ctx *gecko_decoder;
 
 /**
  * Initialize BGLIB
  * @param OFUNC
  * @param IFUNC
  */
-#define BGLIB_INITIALIZE(OFUNC,IFUNC) bglib_output=OFUNC;bglib_input=IFUNC;bglib_peek=NULL;
+#define BGLIB_INITIALIZE(OFUNC,IFUNC) bglib_output=OFUNC;bglib_input=IFUNC;bglib_peek=NULL;bglib_pollfd=NULL;
 
 /**
  * Initialize BGLIB to support nonblocking mode
  * @param OFUNC
  * @param IFUNC
- * @param PFUNC peek function to check if there is data to be read from UART
+ * @param PFUNC peek function returning how many bytes can be read from UART without blocking
  */
-#define BGLIB_INITIALIZE_NONBLOCK(OFUNC,IFUNC,PFUNC) bglib_output=OFUNC;bglib_input=IFUNC;bglib_peek=NULL;
+#define BGLIB_INITIALIZE_NONBLOCK(OFUNC,IFUNC,PFUNC) bglib_output=OFUNC;bglib_input=IFUNC;bglib_peek=PFUNC;bglib_pollfd=NULL;
+
+/**
+ * Initialize BGLIB to support nonblocking mode driven from an external poll loop
+ * @param OFUNC
+ * @param IFUNC
+ * @param PFUNC peek function returning how many bytes can be read from UART without blocking
+ * @param FDFUNC function returning a file descriptor that is readable when there is data to be read
+ */
+#define BGLIB_INITIALIZE_POLLABLE(OFUNC,IFUNC,PFUNC,FDFUNC) bglib_output=OFUNC;bglib_input=IFUNC;bglib_peek=PFUNC;bglib_pollfd=FDFUNC;
 
 
 extern void(*bglib_output)(uint16 len1, uint8* data1);
 extern int(*bglib_input)(uint16 len1, uint8* data1);
 extern int(*bglib_peek)(void);
+extern int(*bglib_pollfd)(void);
+
+/**
+ * Reset decoder state
+ * @param ctx decoder to reset
+ * @param on_frame optional function called for each complete frame, may be NULL
+ * @param user passed to on_frame
+ */
+void gecko_decoder_init(struct gecko_decoder_ctx* ctx, void (*on_frame)(struct gecko_cmd_packet* pck, void* user), void* user);
+
+/**
+ * What to do with an event that does not fit in the queue
+ */
+enum gecko_overflow_policy
+{
+    gecko_overflow_drop_newest,      /* drop the new event */
+    gecko_overflow_drop_oldest,      /* drop queued events, oldest first, until it fits */
+    gecko_overflow_coalesce,         /* replace the newest queued event with the same ID and length, in its place, else drop the new event */
+    gecko_overflow_grow,             /* move the queue to larger memory from malloc, else drop the new event */
+    gecko_overflow_block             /* decode thread waits for the application to make room, else drop the new event */
+};
+
+/**
+ * Event queue overflow counters
+ */
+struct gecko_queue_stats
+{
+    uint32_t dropped_newest;         /* new events dropped */
+    uint32_t dropped_oldest;         /* queued events dropped to make room */
+    uint32_t coalesced;              /* new events that replaced a queued one */
+    uint32_t grown;                  /* times the queue was enlarged */
+};
+
+/**
+ * Choose what happens when an event arrives and the queue is full
+ * @param policy action to take
+ * @param max_size largest queue in bytes gecko_overflow_grow may allocate, 0 for no limit
+ */
+void gecko_set_overflow_policy(enum gecko_overflow_policy policy, uint32_t max_size);
+
+/**
+ * Read the event queue overflow counters
+ * @param stats counters output
+ */
+void gecko_get_queue_stats(struct gecko_queue_stats* stats);
+
+/**
+ * Use application storage for the event queue.
+ * Must be called before any data is received, queued events are lost.
+ * @param storage queue memory, 4 byte aligned
+ * @param size size of storage in bytes, rounded down to a power of two
+ * @return queue size in bytes, 0 if storage is too small
+ */
+uint32_t gecko_set_queue(void* storage, uint32_t size);
+
+/**
+ * Most the event queue has held since it was set up
+ * @return bytes
+ */
+uint32_t gecko_queue_high_water(void);
+
+/**
+ * Push data received from the device into the decoder.
+ * Never blocks, partial frames are kept until the rest arrives.
+ * Complete events are queued for gecko_wait_event/gecko_peek_event
+ * and responses are placed in gecko_rsp_msg.
+ * @param ctx decoder to use, normally gecko_decoder
+ * @param data received data
+ * @param len amount of received data
+ * @return number of frames completed
+ */
+int gecko_feed(struct gecko_decoder_ctx* ctx, const uint8_t* data, int len);
+
+/**
+ * Event handler
+ * @param evt event, valid until the handler returns
+ * @param ctx value given when the handler was registered
+ */
+typedef void (*gecko_event_handler)(struct gecko_cmd_packet* evt, void* ctx);
+
+/**
+ * Pass an event to a function instead of returning it from gecko_wait_event.
+ * @param id event ID, for example gecko_evt_system_boot_id
+ * @param fn handler, NULL to remove it
+ * @param ctx passed to the handler
+ * @return 0 on success, -1 if id is not an event or is beyond the table size
+ */
+int gecko_register_handler(uint32_t id, gecko_event_handler fn, void* ctx);
+
+/**
+ * Set the handler for events without their own.
+ * While set, gecko_wait_event never returns as every event is handled,
+ * drive the library with gecko_peek_event instead.
+ * @param fn handler, NULL to return those events to the application again
+ * @param ctx passed to the handler
+ */
+void gecko_register_default_handler(gecko_event_handler fn, void* ctx);
+
+#ifdef BGLIB_THREAD
+/**
+ * Start decoding frames in a background thread.
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int gecko_start_thread(void);
+
+/**
+ * Stop the background thread and wait for it to exit.
+ */
+void gecko_stop_thread(void);
+#endif
 
 #endif
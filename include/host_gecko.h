@@ -51,6 +51,8 @@ extern "C" {
 
 /**
  * Blocks until new event arrives which requires processing by user application.
+ * Events with a registered handler are passed to it instead of returned,
+ * with a default handler set this never returns.
  * 
  * @return pointer to received event
  */
@@ -71,6 +73,15 @@ struct gecko_cmd_packet* gecko_peek_event(void);
  */
 int gecko_event_pending(void);
 
+/**
+ * File descriptor to wait on from an external poll/epoll loop.
+ * It becomes readable when data arrives from the device, then
+ * call gecko_peek_event until it returns NULL.
+ *
+ * @return file descriptor, or -1 if none was provided at initialization
+ */
+int gecko_get_pollable_fd(void);
+
 /**
  *  Initialize stack
  *  @param config if set as NULL uses default values for all configuration parameters
@@ -0,0 +1,253 @@
+/*
+ * BGLib event dispatch benchmark.
+ * Feeds frames for every event in host_gecko.h through gecko_feed, then
+ * drains the queue three ways: returning events without looking at them,
+ * a switch on the event ID, and the registered handler table.
+ * Only draining is timed, decoding is the same for every method, and
+ * the best of several runs is reported.
+ *
+ * Usage: dispatch_bench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "gecko_bglib.h"
+
+BGLIB_DEFINE();
+
+#define BENCH_ROUNDS 100000  //>! Default passes over all events.
+#define BENCH_QUEUE 65536    //>! Event queue size, holds a whole batch.
+#define BENCH_BATCH 128      //>! Rounds queued before each timed drain.
+#define BENCH_REPEATS 5      //>! Runs per method, the fastest is reported.
+
+//Every event in host_gecko.h, X for those with a payload structure, E for empty ones.
+#define BENCH_EVENTS(X, E) \
+    X(dfu_boot) \
+    X(system_boot) \
+    X(le_gap_scan_response) \
+    X(le_connection_opened) \
+    X(le_connection_closed) \
+    X(le_connection_parameters) \
+    X(gatt_mtu_exchanged) \
+    X(gatt_service) \
+    X(gatt_characteristic) \
+    X(gatt_descriptor) \
+    X(gatt_characteristic_value) \
+    X(gatt_descriptor_value) \
+    X(gatt_procedure_completed) \
+    X(gatt_server_attribute_value) \
+    X(gatt_server_user_read_request) \
+    X(gatt_server_user_write_request) \
+    X(gatt_server_characteristic_status) \
+    X(endpoint_syntax_error) \
+    X(endpoint_data) \
+    X(endpoint_status) \
+    X(endpoint_closing) \
+    X(hardware_soft_timer) \
+    X(hardware_interrupt) \
+    X(flash_ps_key) \
+    X(test_dtm_completed) \
+    X(sm_passkey_display) \
+    X(sm_passkey_request) \
+    X(sm_confirm_passkey) \
+    X(sm_bonded) \
+    X(sm_bonding_failed) \
+    X(sm_list_bonding_entry) \
+    E(sm_list_all_bondings_complete) \
+    X(sm_bonding_request)
+
+#define BENCH_ENUM(NAME) BENCH_EVT_##NAME,
+enum { BENCH_EVENTS(BENCH_ENUM, BENCH_ENUM) BENCH_EVENT_COUNT };
+
+#define BENCH_ID(NAME) gecko_evt_##NAME##_id,
+static const uint32_t bench_ids[BENCH_EVENT_COUNT] = { BENCH_EVENTS(BENCH_ID, BENCH_ID) };
+
+#define BENCH_LEN(NAME) sizeof(struct gecko_msg_##NAME##_evt_t),
+#define BENCH_NO_LEN(NAME) 0,
+static const uint16_t bench_lens[BENCH_EVENT_COUNT] = { BENCH_EVENTS(BENCH_LEN, BENCH_NO_LEN) };
+
+static uint32_t bench_queue[BENCH_QUEUE / 4];
+static uint8_t* bench_stream;
+static int bench_stream_len;
+static uint64_t bench_counts[BENCH_EVENT_COUNT];
+
+// The device is never read, everything arrives through gecko_feed.
+static void bench_output(uint16 len, uint8* data)
+{
+}
+
+static int bench_input(uint16 len, uint8* data)
+{
+    return -1;
+}
+
+static int bench_peek(void)
+{
+    return 0;
+}
+
+// Monotonic time in seconds.
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Build one frame of each event, with minimum length payloads.
+static int bench_build(void)
+{
+    int size = 0;
+    int i;
+
+    for (i = 0; i < BENCH_EVENT_COUNT; i++) {
+        size += BGLIB_MSG_HEADER_LEN + bench_lens[i];
+    }
+    bench_stream = calloc(1, size);
+    if (bench_stream == NULL) {
+        return -1;
+    }
+    for (i = 0; i < BENCH_EVENT_COUNT; i++) {
+        uint32_t header = bench_ids[i] | ((bench_lens[i] & 0xff) << 8) | (bench_lens[i] >> 8);
+        memcpy(bench_stream + bench_stream_len, &header, sizeof(header));
+        bench_stream_len += BGLIB_MSG_HEADER_LEN + bench_lens[i];
+    }
+    return 0;
+}
+
+static void bench_handler(struct gecko_cmd_packet* evt, void* ctx)
+{
+    (*(uint64_t*) ctx)++;
+}
+
+#define BENCH_CASE(NAME) case gecko_evt_##NAME##_id: bench_counts[BENCH_EVT_##NAME]++; break;
+
+// Count an event by switching on its ID.
+static void bench_switch(struct gecko_cmd_packet* evt)
+{
+    switch (BGLIB_MSG_ID(evt->header)) {
+    BENCH_EVENTS(BENCH_CASE, BENCH_CASE)
+    default:
+        break;
+    }
+}
+
+// Feed every round and drain the queue, dispatching with the chosen method.
+// Returns the number of events seen, by the application or a handler.
+static uint64_t bench_run(int rounds, int use_switch, double* seconds)
+{
+    struct gecko_cmd_packet* evt;
+    uint64_t seen = 0;
+    double start;
+    int i;
+    int j;
+
+    memset(bench_counts, 0, sizeof(bench_counts));
+    *seconds = 0;
+    for (i = 0; i < rounds; i += BENCH_BATCH) {
+        for (j = i; j < rounds && j < i + BENCH_BATCH; j++) {
+            gecko_feed(gecko_decoder, bench_stream, bench_stream_len);
+        }
+        start = bench_now();
+        while ((evt = gecko_peek_event()) != NULL) {
+            if (use_switch) {
+                bench_switch(evt);
+            } else {
+                seen++;
+            }
+        }
+        *seconds += bench_now() - start;
+    }
+    for (i = 0; i < BENCH_EVENT_COUNT; i++) {
+        seen += bench_counts[i];
+    }
+    return seen;
+}
+
+// Run a method several times, keeping the fastest.
+static uint64_t bench_best(int rounds, int use_switch, double* seconds)
+{
+    uint64_t seen = 0;
+    double run;
+    int i;
+
+    *seconds = 0;
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        seen = bench_run(rounds, use_switch, &run);
+        if (i == 0 || run < *seconds) {
+            *seconds = run;
+        }
+    }
+    return seen;
+}
+
+// Print one result line, checking nothing was lost.
+static int bench_print(const char* name, int rounds, uint64_t seen, double seconds)
+{
+    uint64_t frames = (uint64_t) rounds * BENCH_EVENT_COUNT;
+
+    printf("%-8s %12.0f %10.1f\n", name, frames / seconds, seconds * 1e9 / frames);
+    if (seen != frames) {
+        fprintf(stderr, "%s: %llu of %llu events seen\n", name,
+                (unsigned long long) seen, (unsigned long long) frames);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+    struct gecko_queue_stats stats;
+    double seconds;
+    uint64_t seen;
+    int i;
+
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    BGLIB_INITIALIZE_NONBLOCK(bench_output, bench_input, bench_peek);
+    gecko_set_queue(bench_queue, sizeof(bench_queue));
+    if (bench_build() < 0) {
+        perror("bench_build");
+        return 1;
+    }
+
+    printf("%d rounds of %d events, %d bytes each round\n", rounds, BENCH_EVENT_COUNT, bench_stream_len);
+    printf("%-8s %12s %10s\n", "dispatch", "events/s", "ns/event");
+
+    seen = bench_best(rounds, 0, &seconds);
+    if (bench_print("none", rounds, seen, seconds) < 0) {
+        return 1;
+    }
+
+    seen = bench_best(rounds, 1, &seconds);
+    if (bench_print("switch", rounds, seen, seconds) < 0) {
+        return 1;
+    }
+
+    //Handlers take every event, so the queue drains without returning any.
+    for (i = 0; i < BENCH_EVENT_COUNT; i++) {
+        if (gecko_register_handler(bench_ids[i], bench_handler, &bench_counts[i]) < 0) {
+            fprintf(stderr, "event %08x has no handler slot\n", (unsigned) bench_ids[i]);
+            return 1;
+        }
+    }
+    seen = bench_best(rounds, 0, &seconds);
+    if (bench_print("handler", rounds, seen, seconds) < 0) {
+        return 1;
+    }
+
+    gecko_get_queue_stats(&stats);
+    if (stats.dropped_newest || stats.dropped_oldest || stats.coalesced) {
+        fprintf(stderr, "queue overflowed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Serial backend benchmark.
+ * Compares the poll() and io_uring listener backends over a PTY loopback.
+ * One port opens a new PTY, a second port opens its slave side and echoes
+ * everything back, both use the backend under test with a TX queue.
+ *
+ * Usage: serial_bench [frames] [frame size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "uart.h"
+
+#define BENCH_FRAMES 20000   //>! Default frames per run.
+#define BENCH_SIZE 32        //>! Default frame size.
+#define BENCH_MAX_SIZE 4096  //>! Largest frame size.
+#define BENCH_TIMEOUT_MS 1000 //>! Longest wait for an echo.
+
+typedef struct bench_echo_s {
+    serial_t* s;
+    volatile int running;
+} bench_echo_t;
+
+typedef struct bench_result_s {
+    double seconds;
+    double cpu_seconds;
+    long ctx_switches;
+    serial_stats_t stats;
+} bench_result_t;
+
+// Monotonic time in seconds.
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Process CPU time and context switches so far.
+static void bench_usage(double* cpu, long* ctx)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+           + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    *ctx = ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// Send back everything received on the slave side.
+static void* bench_echo(void* param)
+{
+    bench_echo_t* e = (bench_echo_t*) param;
+    uint8_t buff[BENCH_MAX_SIZE];
+
+    while (e->running) {
+        int res = serial_read(e->s, buff, sizeof(buff), 100);
+        if (res > 0 && serial_send(e->s, buff, res) < 0) {
+            perror("echo send");
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Send frames one at a time, waiting for each echo.
+static int bench_pingpong(serial_t* s, int frames, int size)
+{
+    uint8_t out[BENCH_MAX_SIZE];
+    uint8_t in[BENCH_MAX_SIZE];
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        memset(out, i, size);
+        if (serial_send(s, out, size) < 0) {
+            perror("send");
+            return -1;
+        }
+        if (serial_read_exact(s, in, size, BENCH_TIMEOUT_MS) != size) {
+            fprintf(stderr, "frame %d: echo timed out\n", i);
+            return -1;
+        }
+        if (memcmp(in, out, size) != 0) {
+            fprintf(stderr, "frame %d: echo corrupted\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Run one backend, flags select it.
+static int bench_run(int flags, int frames, int size, bench_result_t* result)
+{
+    serial_config_t config;
+    bench_echo_t echo;
+    pthread_t thread;
+    serial_t* master;
+    double start_cpu;
+    long start_ctx;
+    double start;
+    int res;
+
+    //The RX ring must hold a whole frame for serial_read_exact.
+    master = serial_create(2 * BENCH_MAX_SIZE, flags);
+    echo.s = serial_create(2 * BENCH_MAX_SIZE, flags);
+    if (master == NULL || echo.s == NULL) {
+        perror("serial_create");
+        return -1;
+    }
+    serial_config_init(&config, 115200);
+    if (serial_connect_config(master, "pty:", &config) < 0) {
+        perror("connect pty:");
+        return -1;
+    }
+    if (serial_connect_config(echo.s, serial_peer_name(master), &config) < 0) {
+        perror("connect peer");
+        return -1;
+    }
+    echo.running = 1;
+    pthread_create(&thread, NULL, bench_echo, &echo);
+
+    bench_usage(&start_cpu, &start_ctx);
+    start = bench_now();
+    res = bench_pingpong(master, frames, size);
+    result->seconds = bench_now() - start;
+    bench_usage(&result->cpu_seconds, &result->ctx_switches);
+    result->cpu_seconds -= start_cpu;
+    result->ctx_switches -= start_ctx;
+    serial_get_stats(master, &result->stats);
+
+    echo.running = 0;
+    pthread_join(thread, NULL);
+    serial_close(echo.s);
+    serial_close(master);
+    serial_destroy(echo.s);
+    serial_destroy(master);
+    return res;
+}
+
+// Print one result line.
+static void bench_print(const char* name, int frames, const bench_result_t* r)
+{
+    printf("%-8s %10.0f %10.2f %10.2f %10.2f %10.2f\n",
+           name,
+           frames / r->seconds,
+           r->seconds * 1e6 / frames,
+           r->cpu_seconds * 1e6 / frames,
+           (double) r->stats.rx_reads / frames,
+           (double) r->ctx_switches / frames);
+}
+
+int main(int argc, char* argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : BENCH_FRAMES;
+    int size = argc > 2 ? atoi(argv[2]) : BENCH_SIZE;
+    bench_result_t result;
+
+    if (frames <= 0 || size <= 0 || size > BENCH_MAX_SIZE) {
+        fprintf(stderr, "usage: %s [frames] [frame size <= %d]\n", argv[0], BENCH_MAX_SIZE);
+        return 1;
+    }
+
+    printf("%d frames of %d bytes, PTY loopback\n", frames, size);
+    printf("%-8s %10s %10s %10s %10s %10s\n",
+           "backend", "frames/s", "rtt us", "cpu us", "reads", "ctxsw");
+
+    if (bench_run(SERIAL_FLAG_TX_QUEUE, frames, size, &result) < 0) {
+        return 1;
+    }
+    bench_print("poll", frames, &result);
+
+    if (bench_run(SERIAL_FLAG_TX_QUEUE | SERIAL_FLAG_URING, frames, size, &result) < 0) {
+        return 1;
+    }
+    bench_print("io_uring", frames, &result);
+
+    return 0;
+}
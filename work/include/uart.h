@@ -2,10 +2,21 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
-#define BUFF_SIZE 512
-#define POLL_TIMEOUT 2000
+#define BUFF_SIZE 512     //>! Default RX ring size.
+
+#define SERIAL_TX_SIZE 4096 //>! TX queue size.
+#define SERIAL_REACTOR_EVENTS 32 //>! Events fetched per reactor wakeup.
+#define SERIAL_STATS_BUCKETS 16 //>! Read size histogram buckets.
+#define SERIAL_STAMPS 256   //>! RX chunk timestamps kept, must be a power of two.
+#define SERIAL_CONNECT_MS 1000 //>! Longest wait for a TCP connect.
+
+#define SERIAL_FLAG_MIRRORED 0x01  //>! Map the RX ring twice so reads never wrap.
+#define SERIAL_FLAG_TX_QUEUE 0x02  //>! Transmit from a dedicated thread via a queue.
+#define SERIAL_FLAG_URING    0x04  //>! Use io_uring instead of poll() and read(), with SERIAL_FLAG_TX_QUEUE writes go through it too.
 
 #include <stdint.h>
+#include <sched.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,22 +24,156 @@ extern "C" {
 
 
 typedef struct serial_s serial_t;
+typedef struct serial_reactor_s serial_reactor_t;
+
+/**
+ * Link state callback.
+ * Called from the serial thread when the device is lost or regained.
+ * @param s - serial structure.
+ * @param up - 1 when the link is restored, 0 when it is lost.
+ * @param ctx - context passed to serial_set_link_callback.
+ */
+typedef void (*serial_link_cb_t)(serial_t* s, int up, void* ctx);
+
+/**
+ * @struct Link counters.
+ */
+typedef struct serial_link_stats_s {
+    uint32_t disconnects;    //>! Number of times the device was lost.
+    uint32_t reconnects;     //>! Number of successful reconnects.
+    uint32_t attempts;       //>! Number of reconnect attempts.
+} serial_link_stats_t;
+
+/**
+ * @struct Transport counters.
+ * Read-size bucket i counts reads of 2^i to 2^(i+1)-1 bytes,
+ * the last bucket also counts anything larger.
+ */
+typedef struct serial_stats_s {
+    uint64_t rx_bytes;       //>! Bytes read from the device.
+    uint64_t tx_bytes;       //>! Bytes written to the device.
+    uint64_t rx_reads;       //>! Number of reads issued to the device.
+    uint64_t rx_read_sizes[SERIAL_STATS_BUCKETS]; //>! Histogram of read sizes.
+    uint64_t rx_wakeups;     //>! Number of times the RX path was woken for the device.
+    uint64_t rx_dropped;     //>! Bytes lost because the RX buffer was full.
+    uint64_t tx_short;       //>! Number of writes that took less than offered.
+    uint32_t rx_high_water;  //>! Most data ever held in the RX buffer.
+} serial_stats_t;
+
+/**
+ * @struct Listener thread settings.
+ * Use serial_thread_config_init to fill in defaults before
+ * changing individual fields.
+ */
+typedef struct serial_thread_config_s {
+    int policy;              //>! Scheduling policy, SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+    int priority;            //>! Priority for SCHED_FIFO and SCHED_RR.
+    uint64_t cpus;           //>! Mask of CPUs the listener may run on, 0 for any.
+    int lock_memory;         //>! Lock all process memory with mlockall before starting.
+    int busy_poll_us;        //>! Keep polling this long after data arrives before sleeping, 0 to always sleep.
+} serial_thread_config_t;
+
+/**
+ * @struct Serial line settings.
+ * Use serial_config_init to fill in defaults before
+ * changing individual fields.
+ */
+typedef struct serial_config_s {
+    int baud;                //>! Baud rate for connection.
+    int raw;                 //>! Disable line discipline processing (cfmakeraw).
+    int vmin;                //>! Minimum characters per read (VMIN).
+    int vtime;               //>! Inter-character timeout in deciseconds (VTIME).
+    int rtscts;              //>! Enable hardware RTS/CTS flow control.
+    char parity;             //>! Parity, 'N', 'E' or 'O'.
+    int data_bits;           //>! Data bits, 5 to 8.
+    int stop_bits;           //>! Stop bits, 1 or 2.
+    int low_latency;         //>! Request ASYNC_LOW_LATENCY from the driver.
+} serial_config_t;
 
 /**
  * Create the serial structure.
  * Convenience method to allocate memory
  * and instantiate objects.
- * @return serial structure.
+ * The RX buffer is rounded up to a power of two, and to a
+ * whole number of pages when SERIAL_FLAG_MIRRORED is set.
+ * @param capacity - RX buffer size, 0 for BUFF_SIZE, at most 2^30.
+ * @param flags - SERIAL_FLAG_* options.
+ * @return serial structure, NULL on error.
  */
-serial_t* serial_create();
+serial_t* serial_create(uint32_t capacity, int flags);
 
 /**
  * Destroy the serial structure
+ * Closes the port first if it is still open.
  */
 void serial_destroy(serial_t* s);
 
 /**
- * Connect to a serial device.
+ * Create a reactor.
+ * A reactor services RX for any number of ports from a
+ * fixed pool of epoll threads, instead of one thread per port.
+ * @param threads - number of worker threads, at least one.
+ * @param cpus - CPU to pin each worker to (-1 for none), or NULL.
+ * @return reactor structure, NULL on error.
+ */
+serial_reactor_t* serial_reactor_create(int threads, const int cpus[]);
+
+/**
+ * Destroy a reactor.
+ * All ports using the reactor must be closed first.
+ * @param r - reactor structure.
+ */
+void serial_reactor_destroy(serial_reactor_t* r);
+
+/**
+ * Service a port from a reactor rather than its own thread.
+ * Must be called before connecting.
+ * @param s - serial structure.
+ * @param reactor - reactor to use, NULL for a listener thread.
+ * @return 0 on success, -1 if the port is already running.
+ */
+int serial_set_reactor(serial_t* s, serial_reactor_t* reactor);
+
+/**
+ * Fill in default listener thread settings.
+ * Defaults are SCHED_OTHER on any CPU, no memory locking and no busy polling.
+ * @param config - settings to initialise.
+ */
+void serial_thread_config_init(serial_thread_config_t* config);
+
+/**
+ * Set up the listener thread used for RX.
+ * Applied when the listener is spawned, so ports serviced by
+ * a reactor are not affected.
+ * Real-time policies and memory locking usually need CAP_SYS_NICE
+ * and CAP_IPC_LOCK, connecting fails if they cannot be applied.
+ * Must be called before connecting.
+ * @param s - serial structure.
+ * @param config - settings to use.
+ * @return 0 on success, -1 if the port is already running.
+ */
+int serial_set_thread_config(serial_t* s, const serial_thread_config_t* config);
+
+/**
+ * Fill in default line settings.
+ * Defaults are raw 8N1, no flow control, VMIN 1,
+ * VTIME 0 and low latency mode.
+ * @param config - settings to initialise.
+ * @param baud - baud rate for connection.
+ */
+void serial_config_init(serial_config_t* config, int baud);
+
+/**
+ * Connect to a serial device using default settings.
+ * The device name selects the transport:
+ *   "/dev/ttyACM0"      - a TTY device.
+ *   "pty:"              - a new PTY pair, see serial_peer_name.
+ *   "tcp://host:port"   - a TCP client, e.g. to ser2net.
+ *   "unix:/path"        - a Unix domain stream socket.
+ *   "loop:"             - an in-process loopback, sent data is received.
+ * Line settings only apply to TTY and PTY transports.
+ * Standard rates use the termios constants, other rates
+ * are requested from the driver via termios2 on Linux.
  * @param s - serial structure.
  * @param device - serial device name.
  * @param baud - baud rate for connection.
@@ -36,14 +181,125 @@ void serial_destroy(serial_t* s);
  */
 int serial_connect(serial_t* s, char device[], int baud);
 
+/**
+ * Connect to a serial device with explicit line settings.
+ * @param s - serial structure.
+ * @param device - serial device name.
+ * @param config - line settings, copied for later use.
+ * @return -ve on error, 0 on success.
+ */
+int serial_connect_config(serial_t* s, const char device[], const serial_config_t* config);
+
+/**
+ * Enable automatic reconnection.
+ * When the device fails the port keeps running: buffered RX data is
+ * discarded, writes fail with ENOTCONN and the device is reopened and
+ * reconfigured with exponential backoff until it returns.
+ * Must be called before connecting.
+ * @param s - serial structure.
+ * @param min_ms - initial retry delay in milliseconds, 0 to disable.
+ * @param max_ms - maximum retry delay in milliseconds.
+ * @return 0 on success, -1 if the port is already running.
+ */
+int serial_set_reconnect(serial_t* s, int min_ms, int max_ms);
+
+/**
+ * Set the link state callback.
+ * Called from the thread servicing the port. With a reactor the callback
+ * runs without internal locks held and may close or destroy the port;
+ * with a listener thread it must not, as closing joins that thread.
+ * @param s - serial structure.
+ * @param cb - callback, NULL to disable.
+ * @param ctx - context passed to the callback.
+ */
+void serial_set_link_callback(serial_t* s, serial_link_cb_t cb, void* ctx);
+
+/**
+ * Determine link state.
+ * @param s - serial structure.
+ * @return 1 if the device is connected, 0 otherwise.
+ */
+int serial_link_state(serial_t* s);
+
+/**
+ * Fetch link counters.
+ * @param s - serial structure.
+ * @param stats - counters output.
+ */
+void serial_get_link_stats(serial_t* s, serial_link_stats_t* stats);
+
+/**
+ * Fetch transport counters.
+ * Safe to call from any thread while the port is running,
+ * each counter is read atomically but not as a consistent set.
+ * @param s - serial structure.
+ * @param stats - counters output.
+ */
+void serial_get_stats(serial_t* s, serial_stats_t* stats);
+
+/**
+ * Determine the device name for the other end of the transport.
+ * For a PTY transport this is the slave device to open.
+ * @param s - serial structure.
+ * @return device name, NULL if the transport has none.
+ */
+const char* serial_peer_name(serial_t* s);
+
+/**
+ * Determine the baud rate applied to the device.
+ * For custom rates this is the rate reported by the driver.
+ * @param s - serial structure.
+ * @return baud rate, 0 if not connected.
+ */
+int serial_get_baud(serial_t* s);
+
 /**
  * Send data.
+ * With SERIAL_FLAG_TX_QUEUE the data is queued for the
+ * transmitter thread, waiting for space if the queue is full.
+ * Data sent from different threads is never interleaved.
  * @param s - serial structure.
  * @param data - character array to transmit.
  * @param length - size of the data array.
  */
 int serial_send(serial_t* s, uint8_t data[], int length);
 
+/**
+ * Send data without blocking on a full TX queue.
+ * @param s - serial structure.
+ * @param data - character array to transmit.
+ * @param length - size of the data array.
+ * @return length on success, -1 with errno EAGAIN if the queue is full
+ *         or another thread is still queueing a frame.
+ */
+int serial_try_send(serial_t* s, uint8_t data[], int length);
+
+/**
+ * Wait for queued data to be written to the device.
+ * @param s - serial structure.
+ * @param timeout_ms - timeout in milliseconds, -ve to wait forever.
+ * @return 0 once the TX queue is empty, -1 on timeout or write error.
+ */
+int serial_flush(serial_t* s, int timeout_ms);
+
+/**
+ * Determine how much data is waiting in the TX queue.
+ * @param s - serial structure.
+ * @return number of characters not yet written.
+ */
+int serial_tx_pending(serial_t* s);
+
+/**
+ * Send data from multiple buffers.
+ * Gathers the buffers into as few writes as possible,
+ * retrying until everything has been sent.
+ * @param s - serial structure.
+ * @param iov - array of buffers to transmit.
+ * @param iovcnt - number of buffers in the array.
+ * @return number of bytes sent, -ve on error.
+ */
+int serial_writev(serial_t* s, const struct iovec* iov, int iovcnt);
+
 /**
  * Send a single character.
  * @param s - serial structure.
@@ -51,14 +307,33 @@ int serial_send(serial_t* s, uint8_t data[], int length);
  */
 void serial_put(serial_t* s, uint8_t data);
 
+/**
+ * Determine the size of the serial buffer.
+ * @param s - serial structure.
+ * @return buffer capacity in characters.
+ */
+int serial_capacity(serial_t* s);
+
 /**
  * Determine how much data is available
  * in the serial buffer.
+ * Finding the buffer empty clears the pollable descriptor.
  * @param s - serial structure.
  * @return number of characters available.
  */
 int serial_available(serial_t* s);
 
+/**
+ * Fetch a descriptor for an external poll/epoll loop.
+ * It becomes readable when RX data arrives or the link fails and
+ * stays readable until serial_available finds the buffer empty,
+ * so drain the port on each wakeup.
+ * Created on first use and kept across reconnects.
+ * @param s - serial structure.
+ * @return file descriptor, -1 on error.
+ */
+int serial_pollable_fd(serial_t* s);
+
 /**
  * Fetch one char from the serial buffer.
  * @param s - serial structure.
@@ -66,6 +341,49 @@ int serial_available(serial_t* s);
  */
 char serial_get(serial_t* s);
 
+/**
+ * Read a block of data from the serial buffer.
+ * Waits for at least one character, then copies
+ * out as much as is available up to length.
+ * @param s - serial structure.
+ * @param data - buffer to read into.
+ * @param length - size of the buffer.
+ * @param timeout_ms - timeout in milliseconds, -ve to wait forever.
+ * @return number of characters read, 0 on timeout.
+ */
+int serial_read(serial_t* s, uint8_t* data, int length, int timeout_ms);
+
+/**
+ * Read an exact amount of data from the serial buffer.
+ * Blocks until length characters have been read,
+ * the timeout expires or the port is closed.
+ * @param s - serial structure.
+ * @param data - buffer to read into.
+ * @param length - number of characters to read.
+ * @param timeout_ms - overall timeout in milliseconds, -ve to wait forever.
+ * @return number of characters read (less than length on timeout).
+ */
+int serial_read_exact(serial_t* s, uint8_t* data, int length, int timeout_ms);
+
+/**
+ * Look at buffered data in place, without copying it out.
+ * Returns the longest run of data that is contiguous in memory.
+ * With SERIAL_FLAG_MIRRORED that is everything available.
+ * The data stays valid until it is released with serial_consume.
+ * @param s - serial structure.
+ * @param data - output, start of the data, NULL if empty.
+ * @return number of characters at data.
+ */
+int serial_peek_contiguous(serial_t* s, const uint8_t** data);
+
+/**
+ * Release data looked at with serial_peek_contiguous.
+ * @param s - serial structure.
+ * @param length - number of characters to release.
+ * @return number of characters released.
+ */
+int serial_consume(serial_t* s, int length);
+
 /**
  * Fetch one char from the serial buffer.
  * Blocks until data becomes available.
@@ -74,6 +392,44 @@ char serial_get(serial_t* s);
  */
 char serial_blocking_get(serial_t* s);
 
+/**
+ * Fetch one char from the serial buffer.
+ * Blocks until data becomes available or the timeout expires.
+ * @param s - serial structure.
+ * @param timeout_ms - timeout in milliseconds, -ve to wait forever.
+ * @return character, or -1 on timeout or disconnect.
+ */
+int serial_get_timeout(serial_t* s, int timeout_ms);
+
+/**
+ * Wait for data in the serial buffer.
+ * Sleeps until at least n characters are available,
+ * the timeout expires or the port is closed.
+ * @param s - serial structure.
+ * @param n - number of characters to wait for.
+ * @param timeout_ms - timeout in milliseconds, -ve to wait forever.
+ * @return number of characters available (less than n on timeout).
+ */
+int serial_wait_available(serial_t* s, int n, int timeout_ms);
+
+/**
+ * Determine the stream offset of the next character to be read.
+ * Offsets count every character received and wrap at 2^32.
+ * @param s - serial structure.
+ * @return offset of the next unread character.
+ */
+uint32_t serial_rx_position(serial_t* s);
+
+/**
+ * Look up when a character arrived.
+ * Each read() from the device is stamped with CLOCK_MONOTONIC_RAW,
+ * and the last SERIAL_STAMPS chunks are kept.
+ * @param s - serial structure.
+ * @param offset - stream offset, see serial_rx_position.
+ * @return arrival time in nanoseconds, 0 if no longer known.
+ */
+uint64_t serial_byte_timestamp(serial_t* s, uint32_t offset);
+
 /**
  * Clear the serial buffer.
  * @param s - serial structure.
@@ -82,8 +438,11 @@ void serial_clear(serial_t* s);
 
 /**
  * Close the serial port.
+ * Wakes and joins the serial threads before closing the
+ * device, so it returns without waiting on a poll timeout.
+ * Safe to call on a port that is already closed.
  * @param s - serial structure.
- * @return value of close().
+ * @return 0.
  */
 int serial_close(serial_t* s);
 
@@ -1,12 +1,14 @@
 
+#include <stddef.h>
+
 #include "uart.h"
 
 class Serial
 {
 public:
-	Serial()
+	Serial(uint32_t capacity = 0, int flags = 0)
 	{
-		_serial = serial_create();
+		_serial = serial_create(capacity, flags);
 	}
 	~Serial()
 	{
@@ -17,18 +19,79 @@ public:
 	{
 		return serial_connect(_serial, device, baud);
 	}
+	int Connect(const char device[], const serial_config_t& config)
+	{
+		return serial_connect_config(_serial, device, &config);
+	}
+	int SetThreadConfig(const serial_thread_config_t& config)
+	{
+		return serial_set_thread_config(_serial, &config);
+	}
+	int SetReconnect(int min_ms, int max_ms)
+	{
+		return serial_set_reconnect(_serial, min_ms, max_ms);
+	}
+	void SetLinkCallback(serial_link_cb_t cb, void* ctx)
+	{
+		serial_set_link_callback(_serial, cb, ctx);
+	}
+	int LinkState()
+	{
+		return serial_link_state(_serial);
+	}
+	void LinkStats(serial_link_stats_t* stats)
+	{
+		serial_get_link_stats(_serial, stats);
+	}
+	void Stats(serial_stats_t* stats)
+	{
+		serial_get_stats(_serial, stats);
+	}
+	const char* PeerName()
+	{
+		return serial_peer_name(_serial);
+	}
+	int Baud()
+	{
+		return serial_get_baud(_serial);
+	}
 	int Send(uint8_t data[], int length)
 	{
 		return serial_send(_serial, data, length);
 	}
+	int TrySend(uint8_t data[], int length)
+	{
+		return serial_try_send(_serial, data, length);
+	}
+	int Flush(int timeout_ms = -1)
+	{
+		return serial_flush(_serial, timeout_ms);
+	}
+	int Write(const uint8_t* data, size_t length)
+	{
+		struct iovec iov = { (void*)data, length };
+		return serial_writev(_serial, &iov, 1);
+	}
+	int Write(const struct iovec* iov, int iovcnt)
+	{
+		return serial_writev(_serial, iov, iovcnt);
+	}
 	void Put(uint8_t data)
 	{
 		return serial_put(_serial, data);
 	}
+	int Capacity()
+	{
+		return serial_capacity(_serial);
+	}
 	int Available()
 	{
 		return serial_available(_serial);
 	}
+	int PollableFd()
+	{
+		return serial_pollable_fd(_serial);
+	}
 	char Get()
 	{
 		return serial_get(_serial);
@@ -37,6 +100,38 @@ public:
 	{
 		return serial_blocking_get(_serial);
 	}
+	int Read(uint8_t* data, size_t length, int timeout_ms = -1)
+	{
+		return serial_read(_serial, data, (int)length, timeout_ms);
+	}
+	int ReadExact(uint8_t* data, size_t length, int timeout_ms = -1)
+	{
+		return serial_read_exact(_serial, data, (int)length, timeout_ms);
+	}
+	int PeekContiguous(const uint8_t** data)
+	{
+		return serial_peek_contiguous(_serial, data);
+	}
+	int Consume(int length)
+	{
+		return serial_consume(_serial, length);
+	}
+	int ReadBlocking(int timeout_ms = -1)
+	{
+		return serial_get_timeout(_serial, timeout_ms);
+	}
+	int WaitAvailable(int n, int timeout_ms = -1)
+	{
+		return serial_wait_available(_serial, n, timeout_ms);
+	}
+	uint32_t RxPosition()
+	{
+		return serial_rx_position(_serial);
+	}
+	uint64_t ByteTimestamp(uint32_t offset)
+	{
+		return serial_byte_timestamp(_serial, offset);
+	}
 	void Clear()
 	{
 		return serial_clear(_serial);
@@ -32,9 +32,16 @@ int main(int argc, char** argv) {
 
 	std::cout << "Connected" << std::endl;
 
-	while(running) {	
-		if(s.Available() > 0) {
-			cout << s.Get();
+	while(running) {
+		// Sleep until data arrives, waking periodically to check for exit.
+		if(s.WaitAvailable(1, 100) > 0) {
+			while(s.Available() > 0) {
+				cout << s.Get();
+			}
+		} else if(!s.LinkState()) {
+			// Listener has exited, nothing more will arrive.
+			std::cout << "Disconnected" << std::endl;
+			break;
 		}
 	}
 
@@ -1,18 +1,179 @@
 
+#define _GNU_SOURCE
+
 #include "uart.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <asm/ioctls.h>
+#include <linux/serial.h>
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+
+/**
+ * @struct Kernel termios2, used to set arbitrary baud rates.
+ * Declared locally as asm/termbits.h clashes with termios.h.
+ */
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#endif
+
+/**
+ * @struct Single producer / single consumer byte ring.
+ * Indices run freely and are masked on access, so the size must be a power
+ * of two. The producer owns head and the consumer owns tail; each publishes
+ * its index with release semantics and reads the other's with acquire.
+ * A mirrored ring maps its storage twice back to back, so any region of up
+ * to size bytes starting inside the first mapping is contiguous.
+ * The producer may ask for everything written so far to be discarded; the
+ * consumer applies the request the next time it looks at the ring.
+ */
+typedef struct ring_s {
+    uint8_t* data;           //>! Ring storage.
+    uint32_t size;           //>! Ring capacity in bytes (power of two).
+    uint32_t mask;           //>! Index mask (size - 1).
+    uint32_t head;           //>! Write index, owned by the producer.
+    uint32_t tail;           //>! Read index, owned by the consumer.
+    int mirrored;            //>! Storage is mapped twice back to back.
+    uint32_t flush_to;       //>! Producer requested discard point.
+    uint32_t flush_gen;      //>! Bumped by the producer for each discard request.
+    uint32_t flush_seen;     //>! Last discard request applied by the consumer.
+} ring_t;
+
+#ifdef __NR_io_uring_setup
+/**
+ * @struct Minimal io_uring instance.
+ * Just enough of the submission and completion rings to
+ * keep reads posted without pulling in liburing.
+ */
+typedef struct serial_uring_s {
+    int fd;                  //>! io_uring file descriptor.
+    unsigned* sq_head;       //>! Submission queue head, owned by the kernel.
+    unsigned* sq_tail;       //>! Submission queue tail, owned by us.
+    unsigned* sq_mask;       //>! Submission queue index mask.
+    unsigned* sq_array;      //>! Submission queue index array.
+    unsigned* cq_head;       //>! Completion queue head, owned by us.
+    unsigned* cq_tail;       //>! Completion queue tail, owned by the kernel.
+    unsigned* cq_mask;       //>! Completion queue index mask.
+    struct io_uring_sqe* sqes; //>! Submission queue entries.
+    struct io_uring_cqe* cqes; //>! Completion queue entries.
+    void* sq_ptr;            //>! Submission ring mapping.
+    size_t sq_len;           //>! Submission ring mapping size.
+    void* cq_ptr;            //>! Completion ring mapping.
+    size_t cq_len;           //>! Completion ring mapping size.
+    size_t sqes_len;         //>! Submission entries mapping size.
+    unsigned pending;        //>! Entries queued but not yet submitted.
+} serial_uring_t;
+
+#define SERIAL_URING_RX 1    //>! user_data of the device read.
+#define SERIAL_URING_WAKE 2  //>! user_data of the shutdown wakeup poll.
+#define SERIAL_URING_TX 3    //>! user_data of a queued TX write.
+#define SERIAL_URING_TXWAKE 4 //>! user_data of the TX kick read.
+#define SERIAL_URING_ENTRIES 8 //>! Submission entries, covers every request kept in flight.
+#endif
+
+/**
+ * @struct Transport backend.
+ * Every backend yields pollable file descriptors, so the listener,
+ * reactor and io_uring paths work unchanged over any of them.
+ * Backends are selected by the prefix of the device name.
+ */
+typedef struct serial_transport_s {
+    const char* prefix;      //>! Device name prefix, empty for the TTY default.
+    int stream;              //>! A zero length read means the peer has gone.
+    /**
+     * Open the transport.
+     * @param s - serial structure.
+     * @param address - device name with the prefix removed.
+     * @param fd - output descriptor to read from.
+     * @param txfd - output descriptor to write to.
+     * @return 0 on success, -1 on error.
+     */
+    int (*open)(serial_t* s, const char* address, int* fd, int* txfd);
+    /**
+     * Apply line settings, NULL if the transport has none.
+     * @param s - serial structure.
+     * @return 0 on success, -1 on error.
+     */
+    int (*configure)(serial_t* s);
+} serial_transport_t;
+
+/**
+ * @struct RX chunk timestamp.
+ * Marks the stream offset of the first byte of a read() chunk
+ * and the time at which the chunk arrived.
+ */
+typedef struct serial_stamp_s {
+    uint32_t offset;         //>! Stream offset of the chunk's first byte.
+    uint64_t time_ns;        //>! CLOCK_MONOTONIC_RAW arrival time in nanoseconds.
+} serial_stamp_t;
+
+/**
+ * @struct Reactor worker.
+ * One epoll thread servicing a subset of the reactor's ports.
+ */
+typedef struct serial_worker_s {
+    serial_reactor_t* reactor; //>! Owning reactor.
+    int epfd;                //>! epoll instance for this worker.
+    int wakefd;              //>! eventfd used to wake the worker for shutdown.
+    int cpu;                 //>! CPU to pin the worker to, -1 for none.
+    int count;               //>! Number of ports attached.
+    uint32_t epoch;          //>! Bumped when a port is removed, invalidates in-flight events.
+    serial_t* retry_list;    //>! Ports waiting to reconnect.
+    serial_t* notify_list;   //>! Ports with a link change to report.
+    serial_t* busy;          //>! Port being reopened or notified without the lock held.
+    pthread_mutex_t lock;    //>! Held while dispatching and while adding or removing ports.
+    pthread_cond_t idle;     //>! Signalled when busy is cleared.
+    pthread_t thread;        //>! Worker thread.
+} serial_worker_t;
+
+/**
+ * @struct Serial reactor structure.
+ * A fixed pool of epoll threads servicing any number of ports.
+ */
+struct serial_reactor_s {
+    int running;             //>! Signifies worker thread state.
+    int nworkers;            //>! Number of worker threads.
+    serial_worker_t* workers; //>! Worker array.
+};
 
 /**
  * @struct Serial device structure.
@@ -20,19 +181,90 @@
  */
 struct serial_s {
     int fd;                  //>! Connection file descriptor.
+    int txfd;                //>! Transmit file descriptor, usually the same as fd.
+    int holdfd;              //>! PTY slave held open so the master never hangs up.
+    const serial_transport_t* transport; //>! Transport backend.
+    char peer[64];           //>! Name of the PTY slave for the peer to open.
     int state;               //>! Signifies connection state.
     int running;             //>! Signifies thread state.
+    int baud;                //>! Baud rate applied to the device.
+    serial_config_t config;  //>! Line settings for the device.
+
+    ring_t rxbuff;           //>! Ring buffer for RX data.
+    serial_stamp_t* stamps;  //>! Arrival time of each RX chunk, SERIAL_STAMPS entries.
+    uint32_t stamp_head;     //>! Number of stamps written, owned by the producer.
 
-    char rxbuff[BUFF_SIZE];  //>! Buffer for RX data.
-    int start, end;          //>! Pointers to start and end of buffer.
+    pthread_mutex_t rx_lock; //>! Lock protecting RX waiters.
+    pthread_cond_t rx_cond;  //>! Signalled when RX data arrives.
+    int rx_waiters;          //>! Number of threads waiting for RX data.
+
+    int tx_queued;           //>! Transmit through the TX queue thread.
+    int tx_running;          //>! Signifies TX thread state.
+    int tx_error;            //>! errno of the last failed TX write, 0 if none.
+    ring_t txbuff;           //>! Ring buffer for queued TX data.
+    pthread_mutex_t tx_lock; //>! Guards the TX queue and TX wakeups.
+    pthread_mutex_t tx_send_lock; //>! Held by a producer for its whole frame.
+    pthread_cond_t tx_cond;  //>! Signalled when TX data is queued.
+    pthread_cond_t tx_done_cond; //>! Signalled when queued TX data has been written.
+    pthread_t tx_thread;     //>! Transmitting thread.
 
     pthread_t rx_thread;     //>! Listening thread.
+    int uring;               //>! Listener uses io_uring rather than poll() and read().
+    struct serial_uring_s* uring_ctx; //>! io_uring instance while the listener runs, NULL for poll().
+    int tx_in_ring;          //>! Queued TX data is written by the io_uring listener, no TX thread.
+    int tx_busy;             //>! The io_uring listener has a write in flight.
+    int txwakefd;            //>! eventfd kicking the io_uring listener to write, -1 if unused.
+    int rx_active;           //>! Listening thread exists and has not been joined.
+    int wakefd;              //>! eventfd used to wake the listener for shutdown.
+    int pollfd;              //>! eventfd signalled on RX data for external loops, -1 until requested.
+    serial_reactor_t* reactor; //>! Reactor servicing RX, NULL for a listener thread.
+    serial_worker_t* worker; //>! Reactor worker the port is attached to.
+    int attached;            //>! Port is registered with its worker.
+
+    char* device;            //>! Device name, kept for reconnection.
+    int link_up;             //>! Signifies link state.
+    int reconnect_min;       //>! Initial reconnect delay in ms, 0 if disabled.
+    int reconnect_max;       //>! Maximum reconnect delay in ms.
+    int retry_ms;            //>! Current reconnect delay in ms.
+    struct timespec retry_at; //>! Time of the next reactor reconnect attempt.
+    serial_t* retry_next;    //>! Next port in the worker's reconnect list.
+    int retrying;            //>! Port is in its worker's reconnect list.
+    serial_t* notify_next;   //>! Next port in the worker's notify list.
+    int notify_state;        //>! Link state waiting to be reported by the worker, -1 if none.
+    serial_link_cb_t link_cb; //>! Link state callback.
+    void* link_ctx;          //>! Context passed to the link callback.
+    serial_link_stats_t link_stats; //>! Link counters.
+    serial_stats_t stats;    //>! Transport counters, RX ones written only by the producer.
+    serial_thread_config_t thread_config; //>! Listener thread settings.
 };
 
 // ---------------        Internal Functions        ---------------
 
 static int serial_resolve_baud(int baud);
 
+/**
+ * Apply a custom baud rate using the termios2 interface.
+ * @param s - serial structure.
+ * @param baud - baud rate in bits per second.
+ * @return baud rate reported by the driver, -1 on error.
+ */
+static int serial_set_custom_baud(serial_t* s, int baud);
+
+/**
+ * Apply the stored line settings to the open device.
+ * @param s - serial structure.
+ * @return 0 on success, -1 on error.
+ */
+static int serial_configure(serial_t* s);
+
+/**
+ * Request low latency mode from the serial driver.
+ * This disables receive batching in drivers that support it.
+ * @param s - serial structure.
+ * @return 0 on success, -1 if unsupported.
+ */
+static int serial_set_low_latency(serial_t* s);
+
 /**
  * Recieve data.
  * Retrieves data from the serial device.
@@ -62,208 +294,2293 @@ static void *serial_data_listener(void *param);
  */
 static int serial_start(serial_t* s);
 
+/**
+ * Build listener thread attributes from the thread settings.
+ * @param s - serial structure.
+ * @param attr - attributes to initialise, destroyed on failure.
+ * @return 0 on success, error number on failure.
+ */
+static int serial_thread_attr(serial_t* s, pthread_attr_t* attr);
+
+/**
+ * Read the monotonic clock.
+ * @return current time in microseconds.
+ */
+static uint64_t serial_now_us(void);
+
 /**
  * Stop serial listener thread.
+ * Wakes and joins the listener, then closes the device.
  * @param s - serial structure.
  * @return 0;
  */
 static int serial_stop(serial_t* s);
 
+/**
+ * @brief io_uring Serial Listener Thread.
+ * Keeps a read posted on the device and a poll posted on the
+ * shutdown wakeup, reaping completions and resubmitting the read
+ * in a single io_uring_enter() call per chunk.
+ * With a TX queue it also writes queued data, so completions of
+ * both directions are handled by the same io_uring_enter() call.
+ * @param param - context passed from thread instantiation.
+ */
+static void *serial_data_listener_uring(void *param);
+
+/**
+ * Set up io_uring for the listener.
+ * @param s - serial structure.
+ * @return 0 on success, -1 if io_uring is unavailable.
+ */
+static int serial_uring_create(serial_t* s);
+
+/**
+ * Release the listener's io_uring, once the listener has exited.
+ * @param s - serial structure.
+ */
+static void serial_uring_destroy(serial_t* s);
+
+/**
+ * Ask the writer to send newly queued TX data.
+ * Must be called with the TX lock held, after the data is queued.
+ * @param s - serial structure.
+ */
+static void serial_tx_kick(serial_t* s);
+
+/**
+ * Read pending data from the device into the rx buffer.
+ * Shared by the listener thread and reactor workers.
+ * Data is read straight into the free space of the rx buffer,
+ * the scratch buffer only takes data that does not fit.
+ * @param s - serial structure.
+ * @param buff - scratch buffer to read into.
+ * @param size - size of the scratch buffer.
+ * @return amount of data recieved, -1 on error.
+ */
+static int serial_service_rx(serial_t* s, uint8_t buff[], int size);
+
+/**
+ * Attach a port to the least loaded reactor worker.
+ * @param s - serial structure with a reactor set.
+ * @return 0 on success, -1 on error.
+ */
+static int serial_reactor_attach(serial_t* s);
+
+/**
+ * Detach a port from its reactor worker.
+ * Must be called with the worker lock held.
+ * @param s - serial structure.
+ * @param worker - worker the port is attached to.
+ */
+static void serial_reactor_detach_locked(serial_t* s, serial_worker_t* worker);
+
+/**
+ * @brief Reactor worker thread.
+ * Waits on the worker's epoll instance and services
+ * every port that becomes readable.
+ * @param param - worker structure.
+ */
+static void *serial_reactor_worker(void *param);
+
+/**
+ * @brief Serial Transmitter Thread.
+ * Sleeps until data is queued, then writes everything queued
+ * with a single writev() call per wakeup.
+ * Exits once stopped and the queue has drained, or on write error.
+ * @param param - context passed from thread instantiation.
+ */
+static void *serial_data_transmitter(void *param);
+
+/**
+ * Stop the serial transmitter thread.
+ * Queued data is written before the thread exits.
+ * @param s - serial structure.
+ */
+static void serial_tx_stop(serial_t* s);
+
+/**
+ * Queue data for the transmitter thread.
+ * The buffers are queued atomically with respect to other callers.
+ * @param s - serial structure.
+ * @param iov - array of buffers to queue.
+ * @param iovcnt - number of buffers in the array.
+ * @param block - wait for space rather than failing with EAGAIN.
+ * @return number of bytes queued, -1 on error.
+ */
+static int serial_tx_enqueue(serial_t* s, const struct iovec* iov, int iovcnt, int block);
+
+/**
+ * Write buffers directly to the device.
+ * Retries until everything has been written.
+ * @param s - serial structure.
+ * @param iov - array of buffers to transmit.
+ * @param iovcnt - number of buffers in the array.
+ * @return number of bytes written, -1 on error.
+ */
+static int serial_writev_direct(serial_t* s, const struct iovec* iov, int iovcnt);
+
+/**
+ * Wait until the device can take more data.
+ * Only needed when the listener made a shared descriptor non-blocking.
+ * @param s - serial structure.
+ * @return 0 once writable, -1 on error.
+ */
+static int serial_wait_writable(serial_t* s);
+
 /**
  * Callback to handle recieved data.
  * Puts recieved data into the rx buffer.
+ * Only used when the rx buffer was full at read time,
+ * normally data is read straight into the buffer.
  * @param s - serial structure.
  * @param data - data to be stored.
  * @param length - length of recieved data.
  */
-static void serial_rx_callback(serial_t* s, char data[], int length);
+static void serial_rx_callback(serial_t* s, uint8_t data[], int length);
+
+/**
+ * Publish data read directly into the rx buffer.
+ * Stamps the chunk, makes it visible to the consumer and wakes waiters.
+ * @param s - serial structure.
+ * @param length - length of recieved data.
+ */
+static void serial_rx_commit(serial_t* s, int length);
+
+/**
+ * Count a read issued by the RX path.
+ * @param s - serial structure.
+ * @param length - result of the read.
+ */
+static void serial_stat_read(serial_t* s, int length);
+
+/**
+ * Update the RX buffer high-water mark after new data is published.
+ * @param s - serial structure.
+ */
+static void serial_stat_level(serial_t* s);
+
+/**
+ * Count a write to the device.
+ * @param s - serial structure.
+ * @param offered - number of bytes offered to the write.
+ * @param length - result of the write.
+ */
+static void serial_stat_write(serial_t* s, size_t offered, ssize_t length);
+
+/**
+ * Record the arrival time of the next RX chunk.
+ * Must be called by the producer before the chunk is published.
+ * @param s - serial structure.
+ */
+static void serial_stamp(serial_t* s);
+
+/**
+ * Wake any threads waiting for RX data.
+ * Called by the listener after publishing new data or on exit.
+ * @param s - serial structure.
+ */
+static void serial_rx_notify(serial_t* s);
+
+/**
+ * Compute an absolute deadline on the monotonic clock.
+ * @param deadline - output deadline.
+ * @param timeout_ms - timeout in milliseconds from now.
+ */
+static void serial_deadline(struct timespec* deadline, int timeout_ms);
+
+/**
+ * Milliseconds remaining until a deadline.
+ * @param deadline - deadline from serial_deadline.
+ * @return milliseconds remaining, 0 if it has passed.
+ */
+static int serial_remaining_ms(const struct timespec* deadline);
+
+/**
+ * Select the transport for a device name.
+ * @param device - device name.
+ * @param address - output, device name with the prefix removed.
+ * @return transport backend.
+ */
+static const serial_transport_t* serial_transport_find(const char* device, const char** address);
+
+/**
+ * Close the transport descriptors.
+ * @param s - serial structure.
+ */
+static void serial_close_fds(serial_t* s);
+
+/**
+ * Swap the device descriptors for /dev/null, keeping their numbers
+ * valid for writers.
+ * @param s - serial structure.
+ */
+static void serial_link_park(serial_t* s);
+
+/**
+ * Handle loss of the device.
+ * Parks the descriptors and discards stale RX data.
+ * @param s - serial structure.
+ */
+static void serial_link_lost(serial_t* s);
+
+/**
+ * Report a link change to the application.
+ * @param s - serial structure.
+ * @param up - new link state.
+ */
+static void serial_link_notify(serial_t* s, int up);
+
+/**
+ * Reopen and reconfigure the device after a disconnect.
+ * The new device replaces the parked descriptor in place.
+ * @param s - serial structure.
+ * @return 0 on success, -1 if the device is not back yet.
+ */
+static int serial_link_reopen(serial_t* s);
+
+/**
+ * Record a successful reconnect.
+ * @param s - serial structure.
+ */
+static void serial_link_restored(serial_t* s);
+
+/**
+ * Wait out reconnect backoff in the listener thread.
+ * @param s - serial structure.
+ * @return 0 once reconnected, -1 if the port was closed.
+ */
+static int serial_link_recover(serial_t* s);
+
+/**
+ * Service due reconnect attempts for a reactor worker.
+ * Reopening may block, so it runs without the worker lock held.
+ * @param worker - worker structure.
+ * @return milliseconds until the next attempt, -1 if none are pending.
+ */
+static int serial_reactor_retry(serial_worker_t* worker);
+
+/**
+ * Queue a link change for a reactor worker to report.
+ * Must be called with the worker lock held.
+ * @param worker - worker structure.
+ * @param s - serial structure.
+ * @param up - new link state.
+ */
+static void serial_reactor_notify_locked(serial_worker_t* worker, serial_t* s, int up);
 
-// Put character in rx buffer.
-static int buffer_put(serial_t* s, char c)
+/**
+ * Run queued link callbacks for a reactor worker.
+ * Callbacks may close the port, so they run without the worker lock held.
+ * @param worker - worker structure.
+ */
+static void serial_reactor_notify(serial_worker_t* worker);
+
+// Map size bytes of storage twice, back to back, returns NULL on failure.
+static uint8_t* ring_map_mirrored(uint32_t size)
 {
-    //if there is space in the buffer
-    if ( s->end != ((s->start + BUFF_SIZE - 1) % BUFF_SIZE)) {
-        s->rxbuff[s->end] = c;
-        s->end ++;
-        s->end = s->end % BUFF_SIZE;
-        //printf("Put: %x start: %d, end: %d\r\n", c, s->start, s->end);
-        return 0;        //No error
-    } else {
-        //buffer is full, this is a bad state
-        return -1;        //Report error
+    uint8_t* base;
+    int fd = memfd_create("serial_ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
     }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+    //Reserve the whole window, then map the file over each half.
+    base = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * (size_t)size);
+        close(fd);
+        return NULL;
+    }
+    //The mappings keep the memory alive.
+    close(fd);
+    return base;
 }
 
-// Get character from rx buffer.
-static char buffer_get(serial_t* s)
+// Allocate ring storage of at least capacity bytes, returns -1 on failure.
+static int ring_alloc(ring_t* r, uint32_t capacity, int mirrored)
 {
-    char c = (char)0;
-    //if there is data to process
-    if (s->end != s->start) {
-        c = (s->rxbuff[s->start]);
-        s->start ++;
-        //wrap around
-        s->start = s->start % BUFF_SIZE;
+    uint32_t size = 1;
+
+    //Sizes are reported as int, so stop at the largest power of two below INT_MAX.
+    if (capacity > (1U << 30)) {
+        return -1;
+    }
+
+    //Mirrored mappings must cover whole pages.
+    if (mirrored) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    //Round up to a power of two for index masking.
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    if (mirrored) {
+        r->data = ring_map_mirrored(size);
     } else {
+        r->data = malloc(size);
     }
-    //printf("Get: %x start: %d, end: %d\r\n", c, s->start, s->end);
-    return c;
+    if (r->data == NULL) {
+        return -1;
+    }
+    r->size = size;
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+    r->mirrored = mirrored;
+    r->flush_to = 0;
+    r->flush_gen = 0;
+    r->flush_seen = 0;
+    return 0;
 }
 
-//Get data available in the rx buffer.
-static int buffer_available(serial_t* s)
+// Release ring storage.
+static void ring_free(ring_t* r)
 {
-    return (s->end - s->start + BUFF_SIZE) % BUFF_SIZE;
+    if (r->mirrored) {
+        munmap(r->data, 2 * (size_t)r->size);
+    } else {
+        free(r->data);
+    }
+    r->data = NULL;
 }
 
-// ---------------        External Functions        ---------------
+// Contiguous bytes from offset before storage wraps.
+static uint32_t ring_contiguous(ring_t* r, uint32_t offset)
+{
+    return r->mirrored ? r->size : r->size - offset;
+}
 
-//Create serial object.
-serial_t* serial_create()
+// Apply any discard requested by the producer (consumer side).
+static void ring_sync(ring_t* r)
 {
-    //Allocate serial object.
-    serial_t* s = malloc(sizeof(serial_t));
-    //Reconfigure buffer object.
-    s->start = 0;
-    s->end = 0;
-    //Return pointer.
-    return s;
+    uint32_t gen = __atomic_load_n(&r->flush_gen, __ATOMIC_ACQUIRE);
+    if (gen != r->flush_seen) {
+        uint32_t flush_to = __atomic_load_n(&r->flush_to, __ATOMIC_RELAXED);
+        r->flush_seen = gen;
+        if ((int32_t)(flush_to - r->tail) > 0) {
+            __atomic_store_n(&r->tail, flush_to, __ATOMIC_RELEASE);
+        }
+    }
 }
 
+// Ask the consumer to discard everything written so far (producer side).
+static void ring_flush(ring_t* r)
+{
+    __atomic_store_n(&r->flush_to, r->head, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->flush_gen, 1, __ATOMIC_RELEASE);
+}
 
-void serial_destroy(serial_t* s)
+// Get data available in a ring (consumer side).
+static uint32_t ring_available(ring_t* r)
 {
-    free(s);
+    ring_sync(r);
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    return head - r->tail;
 }
 
+// Get space free in a ring (producer side).
+static uint32_t ring_space(ring_t* r)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return r->size - (r->head - tail);
+}
 
-//Connect to serial device.
-int serial_connect(serial_t* s, char device[], int baud)
+// Put up to length bytes into a ring, returns the number of bytes stored.
+static uint32_t ring_put(ring_t* r, const uint8_t* data, uint32_t length)
 {
-    struct termios oldtio;
+    uint32_t space = ring_space(r);
+    uint32_t offset = r->head & r->mask;
+    uint32_t first;
 
-    // Resolve baud.
-    int speed = serial_resolve_baud(baud);
-    if (speed < 0) {
-        printf("Error: Baud rate not recognized.\r\n");
-        return -1;
+    if (length > space) {
+        length = space;
     }
-
-    //Open device.
-    s->fd = open(device, O_RDWR | O_NOCTTY);
-    //Catch file open error.
-    if (s->fd < 0) {
-        perror(device);
-        return -2;
+    //Copy up to the end of storage, then wrap to the start.
+    first = ring_contiguous(r, offset);
+    if (first > length) {
+        first = length;
     }
-    //Retrieve settings.
-    tcgetattr(s->fd, &oldtio);
-    //Set baud rate.
-    cfsetspeed(&oldtio, speed);
-    //Flush cache.
-    tcflush(s->fd, TCIFLUSH);
-    //Apply settings.
-    tcsetattr(s->fd, TCSANOW, &oldtio);
+    memcpy(&r->data[offset], data, first);
+    memcpy(&r->data[0], data + first, length - first);
 
-    //Start listener thread.
-    int res = serial_start(s);
-    //Catch error.
-    if (res < 0) {
-        printf("Error: serial thread could not be spawned\r\n");
-        return -3;
+    __atomic_store_n(&r->head, r->head + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+// Get up to length bytes from a ring, returns the number of bytes fetched.
+static uint32_t ring_get(ring_t* r, uint8_t* data, uint32_t length)
+{
+    uint32_t available = ring_available(r);
+    uint32_t offset = r->tail & r->mask;
+    uint32_t first;
+
+    if (length > available) {
+        length = available;
     }
+    //Copy up to the end of storage, then wrap to the start.
+    first = ring_contiguous(r, offset);
+    if (first > length) {
+        first = length;
+    }
+    memcpy(data, &r->data[offset], first);
+    memcpy(data + first, &r->data[0], length - first);
 
-    //Indicate connection was successful.
-    s->state = 1;
-    return 0;
+    __atomic_store_n(&r->tail, r->tail + length, __ATOMIC_RELEASE);
+    return length;
 }
 
-//Send data.
-int serial_send(serial_t* s, uint8_t data[], int length)
+// Describe readable data as up to two regions, returns the region count.
+static int ring_read_regions(ring_t* r, struct iovec iov[2])
 {
-    int res = write(s->fd, data, length);
-    return res;
+    uint32_t available = ring_available(r);
+    uint32_t offset = r->tail & r->mask;
+    uint32_t first = ring_contiguous(r, offset);
+
+    if (available == 0) {
+        return 0;
+    }
+    if (first >= available) {
+        iov[0].iov_base = &r->data[offset];
+        iov[0].iov_len = available;
+        return 1;
+    }
+    iov[0].iov_base = &r->data[offset];
+    iov[0].iov_len = first;
+    iov[1].iov_base = &r->data[0];
+    iov[1].iov_len = available - first;
+    return 2;
 }
 
-void serial_put(serial_t* s, uint8_t data)
+// Describe free space as up to two regions, returns the region count (producer side).
+static int ring_write_regions(ring_t* r, struct iovec iov[2])
 {
-    char arr[1];
-    arr[0] = data;
-    write(s->fd, arr, 1);
+    uint32_t space = ring_space(r);
+    uint32_t offset = r->head & r->mask;
+    uint32_t first = ring_contiguous(r, offset);
+
+    if (space == 0) {
+        return 0;
+    }
+    if (first >= space) {
+        iov[0].iov_base = &r->data[offset];
+        iov[0].iov_len = space;
+        return 1;
+    }
+    iov[0].iov_base = &r->data[offset];
+    iov[0].iov_len = first;
+    iov[1].iov_base = &r->data[0];
+    iov[1].iov_len = space - first;
+    return 2;
 }
 
-//Determine characters available.
-int serial_available(serial_t* s)
+// Publish length bytes written in place (producer side).
+static void ring_commit(ring_t* r, uint32_t length)
 {
-    return buffer_available(s);
+    __atomic_store_n(&r->head, r->head + length, __ATOMIC_RELEASE);
 }
 
-//Fetch a character.
-char serial_get(serial_t* s)
+// Release length bytes that have been read in place (consumer side).
+static void ring_consume(ring_t* r, uint32_t length)
 {
-    char c = buffer_get(s);
-
-    return c;
+    __atomic_store_n(&r->tail, r->tail + length, __ATOMIC_RELEASE);
 }
 
-char serial_blocking_get(serial_t* s)
+// Discard all data in a ring (consumer side).
+static void ring_clear(ring_t* r)
 {
-    while (serial_available(s) == 0);
-    return serial_get(s);
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
 }
 
-void serial_clear(serial_t* s)
+// Open a TTY device.
+static int transport_tty_open(serial_t* s, const char* address, int* fd, int* txfd)
 {
-    //Clear the buffer.
-    while (buffer_available(s)) {
-        buffer_get(s);
+    *fd = open(address, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (*fd < 0) {
+        return -1;
     }
+    *txfd = *fd;
+    return 0;
+}
+
+// Open a new PTY pair, the peer opens the slave named in s->peer.
+static int transport_pty_open(serial_t* s, const char* address, int* fd, int* txfd)
+{
+    *fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (*fd < 0) {
+        return -1;
+    }
+    if (grantpt(*fd) < 0 || unlockpt(*fd) < 0
+        || ptsname_r(*fd, s->peer, sizeof(s->peer)) != 0) {
+        close(*fd);
+        return -1;
+    }
+    //Hold the slave open, otherwise the master reports a hangup until the peer opens it.
+    if (s->holdfd >= 0) {
+        close(s->holdfd);
+    }
+    s->holdfd = open(s->peer, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (s->holdfd < 0) {
+        close(*fd);
+        return -1;
+    }
+    *txfd = *fd;
+    return 0;
+}
+
+// Connect a socket, waiting at most SERIAL_CONNECT_MS for the peer.
+static int transport_tcp_connect(int fd, const struct addrinfo* ai)
+{
+    struct pollfd pfd;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, SERIAL_CONNECT_MS) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            return -1;
+        }
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+    //The rest of the port expects blocking writes.
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+// Connect a TCP client, address is host:port.
+static int transport_tcp_open(serial_t* s, const char* address, int* fd, int* txfd)
+{
+    struct addrinfo hints;
+    struct addrinfo* res;
+    struct addrinfo* ai;
+    char host[256];
+    const char* port = strrchr(address, ':');
+    int one = 1;
+
+    if (port == NULL || (size_t)(port - address) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    port++;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    *fd = -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        //Connect without blocking, so an unreachable host cannot hold up a reconnecting worker.
+        *fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+        if (*fd < 0) {
+            continue;
+        }
+        if (transport_tcp_connect(*fd, ai) == 0) {
+            break;
+        }
+        close(*fd);
+        *fd = -1;
+    }
+    freeaddrinfo(res);
+    if (*fd < 0) {
+        return -1;
+    }
+    //Frames are small, do not let Nagle hold them back.
+    setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    *txfd = *fd;
+    return 0;
+}
+
+// Connect a Unix domain stream socket.
+static int transport_unix_open(serial_t* s, const char* address, int* fd, int* txfd)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address);
+
+    *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*fd < 0) {
+        return -1;
+    }
+    if (connect(*fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(*fd);
+        return -1;
+    }
+    *txfd = *fd;
+    return 0;
+}
+
+// Open an in-process loopback, everything sent is received back.
+static int transport_loop_open(serial_t* s, const char* address, int* fd, int* txfd)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    *fd = fds[0];
+    *txfd = fds[1];
+    return 0;
+}
+
+static const serial_transport_t serial_transports[] = {
+    { "pty:", 0, transport_pty_open, serial_configure },
+    { "tcp://", 1, transport_tcp_open, NULL },
+    { "unix:", 1, transport_unix_open, NULL },
+    { "loop:", 1, transport_loop_open, NULL },
+    //The TTY default must come last, it matches anything.
+    { "", 0, transport_tty_open, serial_configure },
+};
+
+// Select a transport by device name prefix.
+static const serial_transport_t* serial_transport_find(const char* device, const char** address)
+{
+    const serial_transport_t* t = serial_transports;
+
+    while (strncmp(device, t->prefix, strlen(t->prefix)) != 0) {
+        t++;
+    }
+    *address = device + strlen(t->prefix);
+    return t;
+}
+
+// Close the transport descriptors.
+static void serial_close_fds(serial_t* s)
+{
+    if (s->txfd >= 0 && s->txfd != s->fd) {
+        close(s->txfd);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->holdfd >= 0) {
+        close(s->holdfd);
+    }
+    s->fd = -1;
+    s->txfd = -1;
+    s->holdfd = -1;
+}
+
+// ---------------        External Functions        ---------------
+
+//Create serial object.
+serial_t* serial_create(uint32_t capacity, int flags)
+{
+    //Allocate serial object.
+    serial_t* s = malloc(sizeof(serial_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    //Allocate buffer object.
+    if (capacity == 0) {
+        capacity = BUFF_SIZE;
+    }
+    if (ring_alloc(&s->rxbuff, capacity, (flags & SERIAL_FLAG_MIRRORED) != 0) < 0) {
+        free(s);
+        return NULL;
+    }
+    //Allocate the RX timestamp side ring.
+    s->stamps = calloc(SERIAL_STAMPS, sizeof(serial_stamp_t));
+    s->stamp_head = 0;
+    if (s->stamps == NULL) {
+        ring_free(&s->rxbuff);
+        free(s);
+        return NULL;
+    }
+    //Allocate the TX queue if requested.
+    s->tx_queued = (flags & SERIAL_FLAG_TX_QUEUE) != 0;
+    s->txbuff.data = NULL;
+    s->txbuff.mirrored = 0;
+    if (s->tx_queued && ring_alloc(&s->txbuff, SERIAL_TX_SIZE, 0) < 0) {
+        ring_free(&s->rxbuff);
+        free(s->stamps);
+        free(s);
+        return NULL;
+    }
+    //Set up wait primitives on the monotonic clock.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->rx_cond, &attr);
+    pthread_cond_init(&s->tx_cond, &attr);
+    pthread_cond_init(&s->tx_done_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&s->rx_lock, NULL);
+    pthread_mutex_init(&s->tx_lock, NULL);
+    pthread_mutex_init(&s->tx_send_lock, NULL);
+    s->tx_running = 0;
+    s->tx_error = 0;
+    s->uring = (flags & SERIAL_FLAG_URING) != 0;
+    s->uring_ctx = NULL;
+    s->tx_in_ring = 0;
+    s->tx_busy = 0;
+    s->txwakefd = -1;
+    s->reactor = NULL;
+    s->worker = NULL;
+    s->attached = 0;
+    s->device = NULL;
+    s->link_up = 0;
+    s->reconnect_min = 0;
+    s->reconnect_max = 0;
+    s->retry_ms = 0;
+    s->retry_next = NULL;
+    s->retrying = 0;
+    s->notify_next = NULL;
+    s->notify_state = -1;
+    s->link_cb = NULL;
+    s->link_ctx = NULL;
+    memset(&s->link_stats, 0, sizeof(s->link_stats));
+    memset(&s->stats, 0, sizeof(s->stats));
+    serial_thread_config_init(&s->thread_config);
+    s->rx_waiters = 0;
+    s->running = 0;
+    s->state = 0;
+    s->fd = -1;
+    s->txfd = -1;
+    s->holdfd = -1;
+    s->transport = NULL;
+    s->peer[0] = '\0';
+    s->wakefd = -1;
+    s->pollfd = -1;
+    s->rx_active = 0;
+    s->baud = 0;
+    //Return pointer.
+    return s;
+}
+
+
+//Create reactor.
+serial_reactor_t* serial_reactor_create(int threads, const int cpus[])
+{
+    serial_reactor_t* r;
+    int i;
+
+    if (threads <= 0) {
+        threads = 1;
+    }
+    r = malloc(sizeof(serial_reactor_t));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->workers = calloc(threads, sizeof(serial_worker_t));
+    if (r->workers == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->nworkers = 0;
+    r->running = 1;
+
+    for (i = 0; i < threads; i++) {
+        serial_worker_t* w = &r->workers[i];
+        struct epoll_event ev;
+
+        w->reactor = r;
+        w->cpu = cpus != NULL ? cpus[i] : -1;
+        w->count = 0;
+        w->epoch = 0;
+        w->retry_list = NULL;
+        w->notify_list = NULL;
+        w->busy = NULL;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (w->epfd < 0 || w->wakefd < 0) {
+            break;
+        }
+        //A NULL pointer marks the wakeup descriptor.
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0) {
+            break;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->idle, NULL);
+        if (pthread_create(&w->thread, NULL, serial_reactor_worker, w) != 0) {
+            pthread_cond_destroy(&w->idle);
+            pthread_mutex_destroy(&w->lock);
+            break;
+        }
+        r->nworkers++;
+    }
+
+    //Unwind a partially created pool.
+    if (r->nworkers != threads) {
+        serial_worker_t* w = &r->workers[r->nworkers];
+        if (w->epfd >= 0) {
+            close(w->epfd);
+        }
+        if (w->wakefd >= 0) {
+            close(w->wakefd);
+        }
+        serial_reactor_destroy(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+//Destroy reactor.
+void serial_reactor_destroy(serial_reactor_t* r)
+{
+    uint64_t one = 1;
+    int i;
+
+    __atomic_store_n(&r->running, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < r->nworkers; i++) {
+        serial_worker_t* w = &r->workers[i];
+        if (write(w->wakefd, &one, sizeof(one)) < 0) {
+            perror("serial_reactor_destroy");
+        }
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->idle);
+        pthread_mutex_destroy(&w->lock);
+        close(w->epfd);
+        close(w->wakefd);
+    }
+    free(r->workers);
+    free(r);
+}
+
+//Service a port from a reactor.
+int serial_set_reactor(serial_t* s, serial_reactor_t* reactor)
+{
+    //Must be chosen before the port is started.
+    if (s->running) {
+        return -1;
+    }
+    s->reactor = reactor;
+    return 0;
+}
+
+void serial_destroy(serial_t* s)
+{
+    //Make sure no thread still refers to the structure.
+    serial_close(s);
+
+    pthread_cond_destroy(&s->rx_cond);
+    pthread_mutex_destroy(&s->rx_lock);
+    pthread_cond_destroy(&s->tx_cond);
+    pthread_cond_destroy(&s->tx_done_cond);
+    pthread_mutex_destroy(&s->tx_lock);
+    pthread_mutex_destroy(&s->tx_send_lock);
+    if (s->pollfd >= 0) {
+        close(s->pollfd);
+    }
+    ring_free(&s->rxbuff);
+    ring_free(&s->txbuff);
+    free(s->device);
+    free(s->stamps);
+    free(s);
+}
+
+
+//Connect to serial device.
+int serial_connect(serial_t* s, char device[], int baud)
+{
+    serial_config_t config;
+
+    serial_config_init(&config, baud);
+    return serial_connect_config(s, device, &config);
+}
+
+//Connect to serial device with explicit line settings.
+int serial_connect_config(serial_t* s, const char device[], const serial_config_t* config)
+{
+    //Release any previous connection.
+    serial_close(s);
+    //Keep copies so the device can be reopened and reconfigured.
+    s->config = *config;
+    free(s->device);
+    s->device = strdup(device);
+    if (s->device == NULL) {
+        return -2;
+    }
+
+    //Open device through the transport its name selects.
+    const char* address;
+    s->transport = serial_transport_find(device, &address);
+    s->peer[0] = '\0';
+    //Catch file open error.
+    if (s->transport->open(s, address, &s->fd, &s->txfd) < 0) {
+        perror(device);
+        s->fd = -1;
+        s->txfd = -1;
+        return -2;
+    }
+    //Apply line settings.
+    if (s->transport->configure != NULL && s->transport->configure(s) < 0) {
+        serial_close_fds(s);
+        return -1;
+    }
+
+    //Start listener thread.
+    int res = serial_start(s);
+    //Catch error.
+    if (res < 0) {
+        printf("Error: serial thread could not be spawned\r\n");
+        return -3;
+    }
+    //Start transmitter thread.
+    if (s->tx_queued && !s->tx_running) {
+        s->tx_error = 0;
+        s->tx_running = 1;
+        //The io_uring listener writes the queue itself.
+        s->tx_in_ring = s->uring_ctx != NULL;
+        res = s->tx_in_ring ? 0 : pthread_create(&s->tx_thread, NULL, serial_data_transmitter, (void*) s);
+        if (res != 0) {
+            s->tx_running = 0;
+            serial_stop(s);
+            printf("Error: serial thread could not be spawned\r\n");
+            return -3;
+        }
+    }
+
+    //Indicate connection was successful.
+    s->state = 1;
+    __atomic_store_n(&s->link_up, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//Fill in default listener thread settings.
+void serial_thread_config_init(serial_thread_config_t* config)
+{
+    config->policy = SCHED_OTHER;
+    config->priority = 0;
+    config->cpus = 0;
+    config->lock_memory = 0;
+    config->busy_poll_us = 0;
+}
+
+//Set up the listener thread.
+int serial_set_thread_config(serial_t* s, const serial_thread_config_t* config)
+{
+    //Must be chosen before the port is started.
+    if (s->running) {
+        return -1;
+    }
+    s->thread_config = *config;
+    return 0;
+}
+
+//Enable automatic reconnection.
+int serial_set_reconnect(serial_t* s, int min_ms, int max_ms)
+{
+    //Must be chosen before the port is started.
+    if (s->running) {
+        return -1;
+    }
+    if (min_ms < 0) {
+        min_ms = 0;
+    }
+    if (max_ms < min_ms) {
+        max_ms = min_ms;
+    }
+    s->reconnect_min = min_ms;
+    s->reconnect_max = max_ms;
+    return 0;
+}
+
+//Set link state callback.
+void serial_set_link_callback(serial_t* s, serial_link_cb_t cb, void* ctx)
+{
+    s->link_cb = cb;
+    s->link_ctx = ctx;
+}
+
+//Determine link state.
+int serial_link_state(serial_t* s)
+{
+    return __atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE);
+}
+
+//Fetch link counters.
+void serial_get_link_stats(serial_t* s, serial_link_stats_t* stats)
+{
+    stats->disconnects = __atomic_load_n(&s->link_stats.disconnects, __ATOMIC_RELAXED);
+    stats->reconnects = __atomic_load_n(&s->link_stats.reconnects, __ATOMIC_RELAXED);
+    stats->attempts = __atomic_load_n(&s->link_stats.attempts, __ATOMIC_RELAXED);
+}
+
+//Fetch transport counters.
+void serial_get_stats(serial_t* s, serial_stats_t* stats)
+{
+    int i;
+
+    stats->rx_bytes = __atomic_load_n(&s->stats.rx_bytes, __ATOMIC_RELAXED);
+    stats->tx_bytes = __atomic_load_n(&s->stats.tx_bytes, __ATOMIC_RELAXED);
+    stats->rx_reads = __atomic_load_n(&s->stats.rx_reads, __ATOMIC_RELAXED);
+    for (i = 0; i < SERIAL_STATS_BUCKETS; i++) {
+        stats->rx_read_sizes[i] = __atomic_load_n(&s->stats.rx_read_sizes[i], __ATOMIC_RELAXED);
+    }
+    stats->rx_wakeups = __atomic_load_n(&s->stats.rx_wakeups, __ATOMIC_RELAXED);
+    stats->rx_dropped = __atomic_load_n(&s->stats.rx_dropped, __ATOMIC_RELAXED);
+    stats->tx_short = __atomic_load_n(&s->stats.tx_short, __ATOMIC_RELAXED);
+    stats->rx_high_water = __atomic_load_n(&s->stats.rx_high_water, __ATOMIC_RELAXED);
+}
+
+//Send data.
+int serial_send(serial_t* s, uint8_t data[], int length)
+{
+    if (s->tx_queued) {
+        struct iovec iov = { data, length };
+        return serial_tx_enqueue(s, &iov, 1, 1);
+    }
+    if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    int res;
+    do {
+        res = write(s->txfd, data, length);
+        serial_stat_write(s, length, res);
+    } while (res < 0 && errno == EAGAIN && serial_wait_writable(s) == 0);
+    return res;
+}
+
+//Queue data without blocking.
+int serial_try_send(serial_t* s, uint8_t data[], int length)
+{
+    struct iovec iov = { data, length };
+
+    if (s->tx_queued) {
+        return serial_tx_enqueue(s, &iov, 1, 0);
+    }
+    return serial_writev_direct(s, &iov, 1);
+}
+
+//Send data from multiple buffers.
+int serial_writev(serial_t* s, const struct iovec* iov, int iovcnt)
+{
+    if (s->tx_queued) {
+        return serial_tx_enqueue(s, iov, iovcnt, 1);
+    }
+    return serial_writev_direct(s, iov, iovcnt);
+}
+
+//Wait for queued data to be written.
+int serial_flush(serial_t* s, int timeout_ms)
+{
+    struct timespec deadline;
+    int res = 0;
+
+    if (!s->tx_queued) {
+        return 0;
+    }
+    if (timeout_ms > 0) {
+        serial_deadline(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&s->tx_lock);
+    while (ring_available(&s->txbuff) > 0 && s->tx_error == 0 && s->tx_running) {
+        if (timeout_ms == 0) {
+            res = ETIMEDOUT;
+        } else if (timeout_ms < 0) {
+            res = pthread_cond_wait(&s->tx_done_cond, &s->tx_lock);
+        } else {
+            res = pthread_cond_timedwait(&s->tx_done_cond, &s->tx_lock, &deadline);
+        }
+        if (res == ETIMEDOUT) {
+            break;
+        }
+    }
+    res = ring_available(&s->txbuff) > 0 || s->tx_error != 0 ? -1 : 0;
+    pthread_mutex_unlock(&s->tx_lock);
+
+    return res;
+}
+
+//Determine data waiting to be transmitted.
+int serial_tx_pending(serial_t* s)
+{
+    int pending;
+
+    if (!s->tx_queued) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->tx_lock);
+    pending = ring_available(&s->txbuff);
+    pthread_mutex_unlock(&s->tx_lock);
+
+    return pending;
+}
+
+//Write buffers to the device.
+static int serial_writev_direct(serial_t* s, const struct iovec* iov, int iovcnt)
+{
+    int total = 0;
+
+    //The descriptor is parked on /dev/null while reconnecting.
+    if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        size_t offered = 0;
+        int i;
+        for (i = 0; i < iovcnt; i++) {
+            offered += iov[i].iov_len;
+        }
+        ssize_t res = writev(s->txfd, iov, iovcnt);
+        serial_stat_write(s, offered, res);
+        if (res < 0) {
+            if (errno == EINTR || (errno == EAGAIN && serial_wait_writable(s) == 0)) {
+                continue;
+            }
+            return -1;
+        }
+        total += res;
+        //Skip buffers that were written completely.
+        while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        //Finish a partially written buffer before moving on.
+        if (iovcnt > 0 && res > 0) {
+            const uint8_t* data = (const uint8_t*)iov->iov_base + res;
+            size_t left = iov->iov_len - res;
+            while (left > 0) {
+                ssize_t count = write(s->txfd, data, left);
+                serial_stat_write(s, left, count);
+                if (count < 0) {
+                    if (errno == EINTR || (errno == EAGAIN && serial_wait_writable(s) == 0)) {
+                        continue;
+                    }
+                    return -1;
+                }
+                data += count;
+                left -= count;
+                total += count;
+            }
+            iov++;
+            iovcnt--;
+        }
+    }
+
+    return total;
+}
+
+//Wait for room to write.
+static int serial_wait_writable(serial_t* s)
+{
+    struct pollfd pfd;
+
+    pfd.fd = s->txfd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+void serial_put(serial_t* s, uint8_t data)
+{
+    serial_send(s, &data, 1);
+}
+
+//Fill in default line settings.
+void serial_config_init(serial_config_t* config, int baud)
+{
+    config->baud = baud;
+    config->raw = 1;
+    config->vmin = 1;
+    config->vtime = 0;
+    config->rtscts = 0;
+    config->parity = 'N';
+    config->data_bits = 8;
+    config->stop_bits = 1;
+    config->low_latency = 1;
+}
+
+//Determine the stream offset of the next character.
+uint32_t serial_rx_position(serial_t* s)
+{
+    ring_sync(&s->rxbuff);
+    return s->rxbuff.tail;
+}
+
+//Look up the arrival time of a character.
+uint64_t serial_byte_timestamp(serial_t* s, uint32_t offset)
+{
+    uint32_t head = __atomic_load_n(&s->stamp_head, __ATOMIC_ACQUIRE);
+    uint32_t count = head < SERIAL_STAMPS ? head : SERIAL_STAMPS;
+    uint32_t lo = head - count;
+    uint32_t hi = head;
+    uint64_t time_ns;
+
+    //Binary search for the newest chunk starting at or before offset.
+    while (lo != hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        serial_stamp_t* stamp = &s->stamps[mid & (SERIAL_STAMPS - 1)];
+        if ((int32_t)(offset - __atomic_load_n(&stamp->offset, __ATOMIC_RELAXED)) >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    //Offset predates every stamp still held.
+    if (lo == head - count) {
+        return 0;
+    }
+    lo--;
+    time_ns = __atomic_load_n(&s->stamps[lo & (SERIAL_STAMPS - 1)].time_ns, __ATOMIC_RELAXED);
+    //Discard the result if the producer overwrote the stamp while we looked.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->stamp_head, __ATOMIC_RELAXED) - lo >= SERIAL_STAMPS) {
+        return 0;
+    }
+    return time_ns;
+}
+
+//Determine the peer device name.
+const char* serial_peer_name(serial_t* s)
+{
+    return s->peer[0] != '\0' ? s->peer : NULL;
+}
+
+//Determine applied baud rate.
+int serial_get_baud(serial_t* s)
+{
+    return s->baud;
+}
+
+//Determine buffer capacity.
+int serial_capacity(serial_t* s)
+{
+    return s->rxbuff.size;
+}
+
+//Determine characters available.
+int serial_available(serial_t* s)
+{
+    int available = ring_available(&s->rxbuff);
+
+    //Clear the pollable descriptor once drained, then recheck for data that raced in.
+    if (available == 0 && s->pollfd >= 0) {
+        uint64_t value;
+        if (read(s->pollfd, &value, sizeof(value)) > 0) {
+            available = ring_available(&s->rxbuff);
+        }
+    }
+    return available;
+}
+
+//Fetch a descriptor for external loops.
+int serial_pollable_fd(serial_t* s)
+{
+    if (s->pollfd < 0) {
+        int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd < 0) {
+            return -1;
+        }
+        //Start readable if data is already waiting.
+        __atomic_store_n(&s->pollfd, fd, __ATOMIC_SEQ_CST);
+        if (ring_available(&s->rxbuff) > 0) {
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0) {
+                //Already signalled.
+            }
+        }
+    }
+    return s->pollfd;
+}
+
+//Fetch a character.
+char serial_get(serial_t* s)
+{
+    uint8_t c = 0;
+
+    ring_get(&s->rxbuff, &c, 1);
+
+    return (char)c;
+}
+
+//Read a block of data.
+int serial_read(serial_t* s, uint8_t* data, int length, int timeout_ms)
+{
+    if (length <= 0) {
+        return 0;
+    }
+    if (serial_wait_available(s, 1, timeout_ms) < 1) {
+        return 0;
+    }
+    return ring_get(&s->rxbuff, data, length);
+}
+
+//Read an exact amount of data.
+int serial_read_exact(serial_t* s, uint8_t* data, int length, int timeout_ms)
+{
+    struct timespec deadline;
+    int count = 0;
+
+    if (timeout_ms > 0) {
+        serial_deadline(&deadline, timeout_ms);
+    }
+
+    while (count < length) {
+        int wait_ms = timeout_ms;
+        int want = length - count;
+        if (timeout_ms > 0) {
+            wait_ms = serial_remaining_ms(&deadline);
+        }
+        //Wait for the whole remainder where it fits, so it arrives in one copy.
+        if ((uint32_t)want > s->rxbuff.size) {
+            want = s->rxbuff.size;
+        }
+        if (serial_wait_available(s, want, wait_ms) == 0 && wait_ms == 0) {
+            break;
+        }
+        count += ring_get(&s->rxbuff, data + count, length - count);
+        //Stop on disconnect or once the timeout has passed.
+        if (count < length && (!__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)
+                || (timeout_ms >= 0 && wait_ms == 0))) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+//Look at buffered data in place.
+int serial_peek_contiguous(serial_t* s, const uint8_t** data)
+{
+    struct iovec iov[2];
+
+    if (ring_read_regions(&s->rxbuff, iov) == 0) {
+        *data = NULL;
+        return 0;
+    }
+    *data = iov[0].iov_base;
+    return iov[0].iov_len;
+}
+
+//Release data looked at in place.
+int serial_consume(serial_t* s, int length)
+{
+    uint32_t available = ring_available(&s->rxbuff);
+
+    if (length < 0) {
+        return 0;
+    }
+    if ((uint32_t)length > available) {
+        length = available;
+    }
+    ring_consume(&s->rxbuff, length);
+    return length;
+}
+
+char serial_blocking_get(serial_t* s)
+{
+    serial_wait_available(s, 1, -1);
+    return serial_get(s);
+}
+
+int serial_get_timeout(serial_t* s, int timeout_ms)
+{
+    uint8_t c;
+
+    if (serial_wait_available(s, 1, timeout_ms) < 1) {
+        return -1;
+    }
+    if (ring_get(&s->rxbuff, &c, 1) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+//Wait for data to become available.
+int serial_wait_available(serial_t* s, int n, int timeout_ms)
+{
+    struct timespec deadline;
+    uint32_t available = ring_available(&s->rxbuff);
+
+    //Fast path, no need to sleep.
+    if (available >= (uint32_t)n || timeout_ms == 0) {
+        return available;
+    }
+    //Cannot wait for more than the buffer holds.
+    if ((uint32_t)n > s->rxbuff.size) {
+        n = s->rxbuff.size;
+    }
+
+    if (timeout_ms > 0) {
+        serial_deadline(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&s->rx_lock);
+    //Register as a waiter before re-checking, pairs with serial_rx_notify.
+    __atomic_add_fetch(&s->rx_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while ((available = ring_available(&s->rxbuff)) < (uint32_t)n
+           && __atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        int res;
+        if (timeout_ms < 0) {
+            res = pthread_cond_wait(&s->rx_cond, &s->rx_lock);
+        } else {
+            res = pthread_cond_timedwait(&s->rx_cond, &s->rx_lock, &deadline);
+        }
+        if (res == ETIMEDOUT) {
+            available = ring_available(&s->rxbuff);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&s->rx_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->rx_lock);
+
+    return available;
+}
+
+void serial_clear(serial_t* s)
+{
+    //Clear the buffer.
+    ring_clear(&s->rxbuff);
 }
 
 //Close serial port.
 int serial_close(serial_t* s)
 {
-    //Stop thread.
-    serial_stop(s);
+    //Stop threads.
+    serial_tx_stop(s);
+    serial_stop(s);
+    return 0;
+}
+
+// ---------------        Internal Functions        --------------
+
+//Stop serial listener thread.
+static int serial_stop(serial_t* s)
+{
+    //Reactor ports are detached here, as there is no thread to exit.
+    //The worker is only known while the port is on it, it may be freed after.
+    serial_worker_t* worker = __atomic_exchange_n(&s->worker, NULL, __ATOMIC_ACQ_REL);
+    if (worker != NULL) {
+        pthread_mutex_lock(&worker->lock);
+        //Let a reopen or callback in progress finish, unless this is that callback.
+        while (worker->busy == s && !pthread_equal(worker->thread, pthread_self())) {
+            pthread_cond_wait(&worker->idle, &worker->lock);
+        }
+        if (s->attached) {
+            serial_reactor_detach_locked(s, worker);
+            //Discard events already fetched for this port.
+            worker->epoch++;
+        } else if (s->retrying) {
+            //Remove from the reconnect list.
+            serial_t** link = &worker->retry_list;
+            while (*link != s) {
+                link = &(*link)->retry_next;
+            }
+            *link = s->retry_next;
+            s->retrying = 0;
+            worker->count--;
+        }
+        if (s->notify_state >= 0) {
+            //Drop the unreported link change.
+            serial_t** link = &worker->notify_list;
+            while (*link != s) {
+                link = &(*link)->notify_next;
+            }
+            *link = s->notify_next;
+            s->notify_state = -1;
+        }
+        serial_close_fds(s);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    __atomic_store_n(&s->running, 0, __ATOMIC_RELEASE);
+    //Wake the listener out of poll() and wait for it to exit.
+    if (__atomic_exchange_n(&s->rx_active, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(s->wakefd, &one, sizeof(one)) < 0) {
+            perror("serial_stop");
+        }
+        pthread_join(s->rx_thread, NULL);
+        serial_uring_destroy(s);
+        close(s->wakefd);
+        s->wakefd = -1;
+    }
+    //The listener has gone, so the device can be closed safely.
+    if (s->reactor == NULL) {
+        serial_close_fds(s);
+    }
+    s->state = 0;
+    __atomic_store_n(&s->link_up, 0, __ATOMIC_RELEASE);
+    serial_rx_notify(s);
+    return 0;
+}
+
+//Attach a port to a reactor worker.
+static int serial_reactor_attach(serial_t* s)
+{
+    serial_reactor_t* r = s->reactor;
+    serial_worker_t* worker = &r->workers[0];
+    struct epoll_event ev;
+    int i;
+
+    //Balance ports across workers.
+    for (i = 1; i < r->nworkers; i++) {
+        if (r->workers[i].count < worker->count) {
+            worker = &r->workers[i];
+        }
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+        pthread_mutex_unlock(&worker->lock);
+        return -1;
+    }
+    worker->count++;
+    __atomic_store_n(&s->worker, worker, __ATOMIC_RELEASE);
+    s->attached = 1;
+    pthread_mutex_unlock(&worker->lock);
+
     return 0;
 }
 
-// ---------------        Internal Functions        --------------
+//Detach a port from its reactor worker.
+static void serial_reactor_detach_locked(serial_t* s, serial_worker_t* worker)
+{
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    worker->count--;
+    s->attached = 0;
+}
+
+//Reactor worker thread.
+static void *serial_reactor_worker(void *param)
+{
+    serial_worker_t* worker = (serial_worker_t*) param;
+    struct epoll_event events[SERIAL_REACTOR_EVENTS];
+    uint8_t buff[BUFF_SIZE];
+    int i;
+
+    //Pin to the requested core.
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    int timeout = -1;
+
+    while (__atomic_load_n(&worker->reactor->running, __ATOMIC_ACQUIRE)) {
+        uint32_t epoch = __atomic_load_n(&worker->epoch, __ATOMIC_ACQUIRE);
+        //Wake in time for the next reconnect attempt.
+        int count = epoll_wait(worker->epfd, events, SERIAL_REACTOR_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error: Polling error in serial reactor\r\n");
+            break;
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        //A port was removed since epoll_wait, events may be stale.
+        //Ports are level triggered so live ones will be reported again.
+        if (worker->epoch != epoch) {
+            count = 0;
+        }
+        for (i = 0; i < count; i++) {
+            serial_t* serial = events[i].data.ptr;
+            if (serial == NULL) {
+                uint64_t value;
+                if (read(worker->wakefd, &value, sizeof(value)) < 0) {
+                    //Nothing to drain.
+                }
+                continue;
+            }
+            if (!serial->attached) {
+                continue;
+            }
+            __atomic_store_n(&serial->stats.rx_wakeups,
+                             serial->stats.rx_wakeups + 1, __ATOMIC_RELAXED);
+            int res = serial_service_rx(serial, buff, sizeof(buff));
+            if (res < 0 || (res == 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))) {
+                //Inform user and detach the port.
+                printf("Error: Serial disconnect\r\n");
+                epoll_ctl(worker->epfd, EPOLL_CTL_DEL, serial->fd, NULL);
+                serial->attached = 0;
+                if (serial->reconnect_min > 0) {
+                    //Keep the port and retry it from this worker.
+                    serial_link_lost(serial);
+                    serial->retry_ms = serial->reconnect_min;
+                    serial_deadline(&serial->retry_at, serial->retry_ms);
+                    serial->retry_next = worker->retry_list;
+                    worker->retry_list = serial;
+                    serial->retrying = 1;
+                    serial_reactor_notify_locked(worker, serial, 0);
+                    continue;
+                }
+                worker->count--;
+                serial_close_fds(serial);
+                //Off the worker for good, so closing the port must not touch it.
+                __atomic_store_n(&serial->worker, NULL, __ATOMIC_RELEASE);
+                __atomic_store_n(&serial->link_up, 0, __ATOMIC_RELEASE);
+                __atomic_store_n(&serial->running, 0, __ATOMIC_RELEASE);
+                serial_rx_notify(serial);
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        timeout = serial_reactor_retry(worker);
+        serial_reactor_notify(worker);
+    }
+
+    return NULL;
+}
+
+//Find a reactor port due to reconnect, or the time until the next one is.
+static serial_t* serial_reactor_due_locked(serial_worker_t* worker, int* timeout)
+{
+    serial_t* serial;
+
+    *timeout = -1;
+    for (serial = worker->retry_list; serial != NULL; serial = serial->retry_next) {
+        int remaining = serial_remaining_ms(&serial->retry_at);
+        if (remaining == 0) {
+            return serial;
+        }
+        if (*timeout < 0 || remaining < *timeout) {
+            *timeout = remaining;
+        }
+    }
+    return NULL;
+}
+
+//Service due reactor reconnects.
+static int serial_reactor_retry(serial_worker_t* worker)
+{
+    serial_t* serial;
+    int timeout;
+
+    pthread_mutex_lock(&worker->lock);
+    while ((serial = serial_reactor_due_locked(worker, &timeout)) != NULL) {
+        struct epoll_event ev;
+        int res;
+
+        //Reopen unlocked, serial_stop waits for it rather than freeing the port.
+        worker->busy = serial;
+        pthread_mutex_unlock(&worker->lock);
+        res = serial_link_reopen(serial);
+        pthread_mutex_lock(&worker->lock);
+        worker->busy = NULL;
+        pthread_cond_broadcast(&worker->idle);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = serial;
+        if (res == 0 && epoll_ctl(worker->epfd, EPOLL_CTL_ADD, serial->fd, &ev) == 0) {
+            //Back up, return the port to normal service.
+            serial_t** link = &worker->retry_list;
+            while (*link != serial) {
+                link = &(*link)->retry_next;
+            }
+            *link = serial->retry_next;
+            serial->retrying = 0;
+            serial->attached = 1;
+            serial_link_restored(serial);
+            serial_reactor_notify_locked(worker, serial, 1);
+            continue;
+        }
+        //Back off exponentially.
+        serial->retry_ms *= 2;
+        if (serial->retry_ms > serial->reconnect_max) {
+            serial->retry_ms = serial->reconnect_max;
+        }
+        serial_deadline(&serial->retry_at, serial->retry_ms);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return timeout;
+}
+
+//Queue a link change for the worker to report.
+static void serial_reactor_notify_locked(serial_worker_t* worker, serial_t* s, int up)
+{
+    serial_t** link = &worker->notify_list;
+
+    if (s->link_cb == NULL) {
+        return;
+    }
+    if (s->notify_state < 0) {
+        //Report in the order changes happened.
+        while (*link != NULL) {
+            link = &(*link)->notify_next;
+        }
+        s->notify_next = NULL;
+        *link = s;
+    }
+    s->notify_state = up;
+}
+
+//Run queued link callbacks.
+static void serial_reactor_notify(serial_worker_t* worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    while (worker->notify_list != NULL) {
+        serial_t* serial = worker->notify_list;
+        int up = serial->notify_state;
+
+        worker->notify_list = serial->notify_next;
+        serial->notify_state = -1;
+        //The callback may close or destroy the port, it is not touched after.
+        worker->busy = serial;
+        pthread_mutex_unlock(&worker->lock);
+        serial_link_notify(serial, up);
+        pthread_mutex_lock(&worker->lock);
+        worker->busy = NULL;
+        pthread_cond_broadcast(&worker->idle);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+//Swap the device for /dev/null, keeping the descriptor numbers.
+static void serial_link_park(serial_t* s)
+{
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    if (null_fd >= 0) {
+        dup2(null_fd, s->fd);
+        if (s->txfd != s->fd) {
+            dup2(null_fd, s->txfd);
+        }
+        close(null_fd);
+    }
+}
+
+//Handle loss of the device.
+static void serial_link_lost(serial_t* s)
+{
+    __atomic_store_n(&s->link_up, 0, __ATOMIC_RELEASE);
+    serial_link_park(s);
+    //Anything buffered belongs to the old session.
+    ring_flush(&s->rxbuff);
+    __atomic_add_fetch(&s->link_stats.disconnects, 1, __ATOMIC_RELAXED);
+}
+
+//Report a link change.
+static void serial_link_notify(serial_t* s, int up)
+{
+    if (s->link_cb != NULL) {
+        s->link_cb(s, up, s->link_ctx);
+    }
+}
+
+//Reopen the device.
+static int serial_link_reopen(serial_t* s)
+{
+    const char* address;
+    int fd;
+    int txfd;
+
+    __atomic_add_fetch(&s->link_stats.attempts, 1, __ATOMIC_RELAXED);
+    serial_transport_find(s->device, &address);
+    if (s->transport->open(s, address, &fd, &txfd) < 0) {
+        return -1;
+    }
+    //Replace the parked descriptors with the device.
+    if (dup2(fd, s->fd) < 0 || (txfd != fd && dup2(txfd, s->txfd) < 0)) {
+        if (txfd != fd) {
+            close(txfd);
+        }
+        close(fd);
+        return -1;
+    }
+    if (txfd != fd) {
+        close(txfd);
+    }
+    close(fd);
+    if (s->transport->configure != NULL && s->transport->configure(s) < 0) {
+        serial_link_park(s);
+        return -1;
+    }
+    return 0;
+}
+
+//Record a reconnect.
+static void serial_link_restored(serial_t* s)
+{
+    s->retry_ms = s->reconnect_min;
+    __atomic_add_fetch(&s->link_stats.reconnects, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->link_up, 1, __ATOMIC_RELEASE);
+}
+
+//Wait out reconnect backoff.
+static int serial_link_recover(serial_t* s)
+{
+    struct pollfd wake;
+
+    wake.fd = s->wakefd;
+    wake.events = POLLIN;
+    s->retry_ms = s->reconnect_min;
+
+    while (__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        //Sleep for the backoff, unless serial_stop wakes us.
+        int res = poll(&wake, 1, s->retry_ms);
+        if (res > 0) {
+            return -1;
+        }
+        if (serial_link_reopen(s) == 0) {
+            serial_link_restored(s);
+            serial_link_notify(s, 1);
+            return 0;
+        }
+        //Back off exponentially.
+        s->retry_ms *= 2;
+        if (s->retry_ms > s->reconnect_max) {
+            s->retry_ms = s->reconnect_max;
+        }
+    }
+
+    return -1;
+}
+
+//Stop serial transmitter thread.
+static void serial_tx_stop(serial_t* s)
+{
+    pthread_mutex_lock(&s->tx_lock);
+    if (!s->tx_running) {
+        pthread_mutex_unlock(&s->tx_lock);
+        return;
+    }
+    s->tx_running = 0;
+    if (s->tx_in_ring) {
+        //Let the listener drain the queue, it fails the queue if it exits first.
+        while (ring_available(&s->txbuff) > 0 && s->tx_error == 0) {
+            pthread_cond_wait(&s->tx_done_cond, &s->tx_lock);
+        }
+        s->tx_in_ring = 0;
+        pthread_mutex_unlock(&s->tx_lock);
+        return;
+    }
+    pthread_cond_signal(&s->tx_cond);
+    pthread_mutex_unlock(&s->tx_lock);
+    //Let the thread drain the queue and exit.
+    pthread_join(s->tx_thread, NULL);
+}
+
+//Wake the writer for newly queued data.
+static void serial_tx_kick(serial_t* s)
+{
+    uint64_t one = 1;
+
+    if (!s->tx_in_ring) {
+        pthread_cond_signal(&s->tx_cond);
+        return;
+    }
+    //Pairs with the listener clearing tx_busy before re-checking the queue.
+    //While a write is in flight the listener picks the data up on completion.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&s->tx_busy, __ATOMIC_SEQ_CST)) {
+        if (write(s->txwakefd, &one, sizeof(one)) < 0) {
+            perror("serial_tx_kick");
+        }
+    }
+}
+
+//Queue data for transmission, tx_lock held.
+static int serial_tx_enqueue_locked(serial_t* s, const struct iovec* iov, int iovcnt, int block, size_t total)
+{
+    int i;
+
+    //Report a failed transmitter.
+    if (s->tx_error != 0 || !s->tx_running) {
+        errno = s->tx_error != 0 ? s->tx_error : EPIPE;
+        return -1;
+    }
+    //Nothing queued now could be delivered, fail as a direct write would.
+    if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    //Apply backpressure to callers that cannot wait.
+    if (!block && ring_space(&s->txbuff) < total) {
+        errno = EAGAIN;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        const uint8_t* data = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            uint32_t count = ring_put(&s->txbuff, data, left);
+            if (count > 0) {
+                data += count;
+                left -= count;
+                serial_tx_kick(s);
+                continue;
+            }
+            //Queue is full, wait for the transmitter to make room.
+            pthread_cond_wait(&s->tx_done_cond, &s->tx_lock);
+            if (s->tx_error != 0 || !s->tx_running) {
+                errno = s->tx_error != 0 ? s->tx_error : EPIPE;
+                return -1;
+            }
+            if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+                errno = ENOTCONN;
+                return -1;
+            }
+        }
+    }
+    return total;
+}
+
+//Queue data for transmission.
+static int serial_tx_enqueue(serial_t* s, const struct iovec* iov, int iovcnt, int block)
+{
+    size_t total = 0;
+    int res;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    //Waiting for room drops tx_lock, the send lock keeps other producers
+    //out until the whole frame is queued so frames are never interleaved.
+    if (block) {
+        pthread_mutex_lock(&s->tx_send_lock);
+    } else if (pthread_mutex_trylock(&s->tx_send_lock) != 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_lock(&s->tx_lock);
+    res = serial_tx_enqueue_locked(s, iov, iovcnt, block, total);
+    pthread_mutex_unlock(&s->tx_lock);
+    pthread_mutex_unlock(&s->tx_send_lock);
+
+    return res;
+}
+
+//Serial data transmitter thread.
+static void *serial_data_transmitter(void *param)
+{
+    serial_t* serial = (serial_t*) param;
+    struct iovec iov[2];
+
+    pthread_mutex_lock(&serial->tx_lock);
+    while (1) {
+        //Sleep until something is queued.
+        while (ring_available(&serial->txbuff) == 0 && serial->tx_running) {
+            pthread_cond_wait(&serial->tx_cond, &serial->tx_lock);
+        }
+        int count = ring_read_regions(&serial->txbuff, iov);
+        if (count == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&serial->tx_lock);
+
+        //Write everything queued so far in one go.
+        int res = serial_writev_direct(serial, iov, count);
+
+        pthread_mutex_lock(&serial->tx_lock);
+        if (res < 0 && errno == ENOTCONN) {
+            //Link is down and being recovered, drop what was queued.
+            ring_consume(&serial->txbuff, ring_available(&serial->txbuff));
+            pthread_cond_broadcast(&serial->tx_done_cond);
+            continue;
+        }
+        if (res < 0) {
+            //Drop the queue and fail pending and future sends.
+            serial->tx_error = errno;
+            ring_clear(&serial->txbuff);
+            pthread_cond_broadcast(&serial->tx_done_cond);
+            break;
+        }
+        ring_consume(&serial->txbuff, res);
+        pthread_cond_broadcast(&serial->tx_done_cond);
+    }
+    pthread_mutex_unlock(&serial->tx_lock);
+
+    return NULL;
+}
+
+//Compute a monotonic deadline.
+static void serial_deadline(struct timespec* deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+//Milliseconds remaining until a deadline.
+static int serial_remaining_ms(const struct timespec* deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000L
+         + (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Resolves standard baud rates to linux constants.
+static int serial_resolve_baud(int baud)
+{
+    int speed;
+    // Switch common baud rates to temios constants.
+    switch (baud) {
+    case 9600:
+        speed = B9600;
+        break;
+    case 19200:
+        speed = B19200;
+        break;
+    case 38400:
+        speed = B38400;
+        break;
+    case 57600:
+        speed = B57600;
+        break;
+    case 115200:
+        speed = B115200;
+        break;
+#ifdef B230400
+    case 230400:
+        speed = B230400;
+        break;
+#endif
+#ifdef B460800
+    case 460800:
+        speed = B460800;
+        break;
+#endif
+#ifdef B500000
+    case 500000:
+        speed = B500000;
+        break;
+#endif
+#ifdef B576000
+    case 576000:
+        speed = B576000;
+        break;
+#endif
+#ifdef B921600
+    case 921600:
+        speed = B921600;
+        break;
+#endif
+#ifdef B1000000
+    case 1000000:
+        speed = B1000000;
+        break;
+#endif
+#ifdef B1152000
+    case 1152000:
+        speed = B1152000;
+        break;
+#endif
+#ifdef B1500000
+    case 1500000:
+        speed = B1500000;
+        break;
+#endif
+#ifdef B2000000
+    case 2000000:
+        speed = B2000000;
+        break;
+#endif
+#ifdef B2500000
+    case 2500000:
+        speed = B2500000;
+        break;
+#endif
+#ifdef B3000000
+    case 3000000:
+        speed = B3000000;
+        break;
+#endif
+#ifdef B3500000
+    case 3500000:
+        speed = B3500000;
+        break;
+#endif
+#ifdef B4000000
+    case 4000000:
+        speed = B4000000;
+        break;
+#endif
+    default:
+        speed = -1;
+        break;
+    }
+    // Return.
+    return speed;
+}
+
+// Apply line settings.
+static int serial_configure(serial_t* s)
+{
+    const serial_config_t* config = &s->config;
+    struct termios tio;
+
+    // Resolve baud, anything non-standard is set through termios2 below.
+    int speed = serial_resolve_baud(config->baud);
+#ifndef TCSETS2
+    if (speed < 0) {
+        printf("Error: Baud rate not recognized.\r\n");
+        return -1;
+    }
+#endif
+
+    //Retrieve settings.
+    if (tcgetattr(s->fd, &tio) < 0) {
+        perror("tcgetattr");
+        return -1;
+    }
+    //Disable line discipline processing for binary data.
+    if (config->raw) {
+        cfmakeraw(&tio);
+    }
+    tio.c_cflag |= CLOCAL | CREAD;
+    //Set character size.
+    tio.c_cflag &= ~CSIZE;
+    switch (config->data_bits) {
+    case 5:
+        tio.c_cflag |= CS5;
+        break;
+    case 6:
+        tio.c_cflag |= CS6;
+        break;
+    case 7:
+        tio.c_cflag |= CS7;
+        break;
+    default:
+        tio.c_cflag |= CS8;
+        break;
+    }
+    //Set parity.
+    tio.c_cflag &= ~(PARENB | PARODD);
+    if (config->parity == 'E' || config->parity == 'e') {
+        tio.c_cflag |= PARENB;
+    } else if (config->parity == 'O' || config->parity == 'o') {
+        tio.c_cflag |= PARENB | PARODD;
+    }
+    //Set stop bits.
+    if (config->stop_bits == 2) {
+        tio.c_cflag |= CSTOPB;
+    } else {
+        tio.c_cflag &= ~CSTOPB;
+    }
+    //Set flow control.
+    if (config->rtscts) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~CRTSCTS;
+    }
+    //Set read behaviour.
+    tio.c_cc[VMIN] = config->vmin;
+    tio.c_cc[VTIME] = config->vtime;
+    //Set baud rate.
+    if (speed >= 0) {
+        cfsetspeed(&tio, speed);
+    }
+    //Flush cache.
+    tcflush(s->fd, TCIFLUSH);
+    //Apply settings.
+    if (tcsetattr(s->fd, TCSANOW, &tio) < 0) {
+        perror("tcsetattr");
+        return -1;
+    }
+    s->baud = config->baud;
+    //Apply non-standard rates, recording what the driver actually chose.
+    if (speed < 0) {
+        s->baud = serial_set_custom_baud(s, config->baud);
+        if (s->baud < 0) {
+            printf("Error: Baud rate not supported.\r\n");
+            return -1;
+        }
+    }
+    //Not every driver supports this, so failure is not an error.
+    if (config->low_latency) {
+        serial_set_low_latency(s);
+    }
+
+    return 0;
+}
 
-//Stop serial listener thread.
-static int serial_stop(serial_t* s)
+// Request driver low latency mode.
+static int serial_set_low_latency(serial_t* s)
 {
-    s->running = 0;
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serinfo;
+
+    if (ioctl(s->fd, TIOCGSERIAL, &serinfo) < 0) {
+        return -1;
+    }
+    serinfo.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(s->fd, TIOCSSERIAL, &serinfo) < 0) {
+        return -1;
+    }
     return 0;
+#else
+    return -1;
+#endif
 }
 
-// Resolves standard baud rates to linux constants.
-static int serial_resolve_baud(int baud)
+// Set an arbitrary baud rate.
+static int serial_set_custom_baud(serial_t* s, int baud)
 {
-    int speed;
-    // Switch common baud rates to temios constants.
-    switch (baud) {
-    case 9600:
-        speed = B9600;
-        break;
-    case 19200:
-        speed = B19200;
-        break;
-    case 38400:
-        speed = B38400;
-        break;
-    case 57600:
-        speed = B57600;
-        break;
-    case 115200:
-        speed = B115200;
-        break;
-    default:
-        speed = -1;
-        break;
+#ifdef TCSETS2
+    struct termios2 tio;
+
+    if (baud <= 0) {
+        return -1;
     }
-    // Return.
-    return speed;
+    if (ioctl(s->fd, TCGETS2, &tio) < 0) {
+        return -1;
+    }
+    //Select BOTHER so the driver uses the explicit speeds.
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_cflag &= ~(CBAUD << IBSHIFT);
+    tio.c_cflag |= BOTHER << IBSHIFT;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    if (ioctl(s->fd, TCSETS2, &tio) < 0) {
+        return -1;
+    }
+    //Read back the rate the driver could actually achieve.
+    if (ioctl(s->fd, TCGETS2, &tio) < 0) {
+        return -1;
+    }
+    return tio.c_ospeed;
+#else
+    return -1;
+#endif
 }
 
 // Start serial listener.
@@ -273,12 +2590,49 @@ static int serial_start(serial_t* s)
     if (s->running != 1) {
         //Set running.
         s->running = 1;
+        //Hand the port to the reactor instead of spawning a thread.
+        if (s->reactor != NULL) {
+            if (serial_reactor_attach(s) < 0) {
+                s->running = 0;
+                return -2;
+            }
+            return 0;
+        }
+        //Create the shutdown wakeup.
+        s->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (s->wakefd < 0) {
+            s->running = 0;
+            return -2;
+        }
+        //Pin memory before the listener can fault on it.
+        if (s->thread_config.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            perror("mlockall");
+            close(s->wakefd);
+            s->wakefd = -1;
+            s->running = 0;
+            return -2;
+        }
+        //Set up io_uring up front so the TX path knows whether the listener writes.
+        void *(*listener)(void*) = serial_data_listener;
+        if (s->uring && serial_uring_create(s) == 0) {
+            listener = serial_data_listener_uring;
+        }
         //Spawn thread.
-        int res;
-        res = pthread_create(&s->rx_thread, NULL, serial_data_listener, (void*) s);
+        pthread_attr_t attr;
+        int res = serial_thread_attr(s, &attr);
+        if (res == 0) {
+            res = pthread_create(&s->rx_thread, &attr, listener, (void*) s);
+            pthread_attr_destroy(&attr);
+        }
         if (res != 0) {
+            errno = res;
+            serial_uring_destroy(s);
+            close(s->wakefd);
+            s->wakefd = -1;
+            s->running = 0;
             return -2;
         }
+        s->rx_active = 1;
         //Return result.
         return 0;
     } else {
@@ -288,6 +2642,54 @@ static int serial_start(serial_t* s)
 
 
 
+//Build listener thread attributes.
+static int serial_thread_attr(serial_t* s, pthread_attr_t* attr)
+{
+    const serial_thread_config_t* config = &s->thread_config;
+    int res = pthread_attr_init(attr);
+
+    if (res != 0) {
+        return res;
+    }
+    //Real-time policies must be set explicitly rather than inherited.
+    if (config->policy != SCHED_OTHER) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        res = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (res == 0) {
+            res = pthread_attr_setschedpolicy(attr, config->policy);
+        }
+        if (res == 0) {
+            res = pthread_attr_setschedparam(attr, &param);
+        }
+    }
+    if (res == 0 && config->cpus != 0) {
+        cpu_set_t cpus;
+        int i;
+        CPU_ZERO(&cpus);
+        for (i = 0; i < 64; i++) {
+            if (config->cpus & (1ULL << i)) {
+                CPU_SET(i, &cpus);
+            }
+        }
+        res = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    }
+    if (res != 0) {
+        pthread_attr_destroy(attr);
+    }
+    return res;
+}
+
+//Read the monotonic clock in microseconds.
+static uint64_t serial_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
 //Recieve data.
 static int serial_recieve(serial_t* s, uint8_t data[], int maxLength)
 {
@@ -295,70 +2697,632 @@ static int serial_recieve(serial_t* s, uint8_t data[], int maxLength)
 }
 
 //Callback to store data in buffer.
-static void serial_rx_callback(serial_t* s, char data[], int length)
+static void serial_rx_callback(serial_t* s, uint8_t data[], int length)
 {
-    //Put data into buffer.
-    int i;
-    //Put data into buffer.
-    for (i = 0; i < length; i++) {
-        buffer_put(s, data[i]);
+    //Stamp the chunk with its arrival time before publishing it.
+    serial_stamp(s);
+    //Put data into buffer, counting what did not fit.
+    uint32_t stored = ring_put(&s->rxbuff, data, length);
+    if (stored < (uint32_t)length) {
+        __atomic_store_n(&s->stats.rx_dropped,
+                         s->stats.rx_dropped + (length - stored), __ATOMIC_RELAXED);
+    }
+    serial_stat_level(s);
+    //Wake anyone waiting on it.
+    serial_rx_notify(s);
+}
+
+//Publish data read in place.
+static void serial_rx_commit(serial_t* s, int length)
+{
+    //Stamp the chunk with its arrival time before publishing it.
+    serial_stamp(s);
+    ring_commit(&s->rxbuff, length);
+    serial_stat_level(s);
+    //Wake anyone waiting on it.
+    serial_rx_notify(s);
+}
+
+//Count a read, only called by the producer so plain stores suffice.
+static void serial_stat_read(serial_t* s, int length)
+{
+    int bucket;
+
+    __atomic_store_n(&s->stats.rx_reads, s->stats.rx_reads + 1, __ATOMIC_RELAXED);
+    if (length <= 0) {
+        return;
+    }
+    __atomic_store_n(&s->stats.rx_bytes, s->stats.rx_bytes + length, __ATOMIC_RELAXED);
+    bucket = 31 - __builtin_clz(length);
+    if (bucket >= SERIAL_STATS_BUCKETS) {
+        bucket = SERIAL_STATS_BUCKETS - 1;
+    }
+    __atomic_store_n(&s->stats.rx_read_sizes[bucket],
+                     s->stats.rx_read_sizes[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+//Track the RX fill level, the consumer only ever lowers it.
+static void serial_stat_level(serial_t* s)
+{
+    uint32_t level = s->rxbuff.head - __atomic_load_n(&s->rxbuff.tail, __ATOMIC_RELAXED);
+
+    if (level > s->stats.rx_high_water) {
+        __atomic_store_n(&s->stats.rx_high_water, level, __ATOMIC_RELAXED);
+    }
+}
+
+//Count a write, senders may race so these are atomic adds.
+static void serial_stat_write(serial_t* s, size_t offered, ssize_t length)
+{
+    if (length < 0) {
+        return;
+    }
+    __atomic_add_fetch(&s->stats.tx_bytes, length, __ATOMIC_RELAXED);
+    if ((size_t)length < offered) {
+        __atomic_add_fetch(&s->stats.tx_short, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//Record chunk arrival time.
+static void serial_stamp(serial_t* s)
+{
+    struct timespec now;
+    uint32_t head = s->stamp_head;
+    serial_stamp_t* stamp = &s->stamps[head & (SERIAL_STAMPS - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    __atomic_store_n(&stamp->offset, s->rxbuff.head, __ATOMIC_RELAXED);
+    __atomic_store_n(&stamp->time_ns, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&s->stamp_head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Wake RX waiters.
+static void serial_rx_notify(serial_t* s)
+{
+    //Order the data publish against the waiter check, pairs with serial_wait_available.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int pollfd = __atomic_load_n(&s->pollfd, __ATOMIC_RELAXED);
+    if (pollfd >= 0) {
+        uint64_t one = 1;
+        if (write(pollfd, &one, sizeof(one)) < 0) {
+            //Counter is saturated, it is readable anyway.
+        }
+    }
+    if (__atomic_load_n(&s->rx_waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&s->rx_lock);
+        pthread_cond_broadcast(&s->rx_cond);
+        pthread_mutex_unlock(&s->rx_lock);
+    }
+}
+
+//Read pending data into the rx buffer.
+static int serial_service_rx(serial_t* s, uint8_t buff[], int size)
+{
+    struct iovec iov[2];
+    int regions = ring_write_regions(&s->rxbuff, iov);
+    int count;
+
+    if (regions > 0) {
+        //Fetch the data straight into the buffer.
+        count = readv(s->fd, iov, regions);
+        serial_stat_read(s, count);
+        if (count > 0) {
+            serial_rx_commit(s, count);
+        }
+    } else {
+        //No room, fetch the data anyway so the device keeps flowing.
+        count = serial_recieve(s, buff, size);
+        serial_stat_read(s, count);
+        if (count > 0) {
+            // Call the serial callback.
+            serial_rx_callback(s, buff, count);
+        }
+    }
+    //If nothing was recieved.
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        count = 0;
+    } else if (count == 0 && s->transport->stream) {
+        //Readable with nothing to read, the peer has closed.
+        errno = ECONNRESET;
+        count = -1;
+    }
+    return count;
+}
+
+#ifdef __NR_io_uring_setup
+// Set up an io_uring instance, returns -1 on failure.
+static int uring_init(serial_uring_t* u, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        return -1;
+    }
+
+    //Map the rings.
+    u->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) {
+            u->sq_len = u->cq_len;
+        }
+        u->cq_len = 0;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    if (u->cq_len == 0) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            munmap(u->sq_ptr, u->sq_len);
+            close(u->fd);
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_len != 0) {
+            munmap(u->cq_ptr, u->cq_len);
+        }
+        munmap(u->sq_ptr, u->sq_len);
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head = (unsigned*)((uint8_t*)u->sq_ptr + params.sq_off.head);
+    u->sq_tail = (unsigned*)((uint8_t*)u->sq_ptr + params.sq_off.tail);
+    u->sq_mask = (unsigned*)((uint8_t*)u->sq_ptr + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((uint8_t*)u->sq_ptr + params.sq_off.array);
+    u->cq_head = (unsigned*)((uint8_t*)u->cq_ptr + params.cq_off.head);
+    u->cq_tail = (unsigned*)((uint8_t*)u->cq_ptr + params.cq_off.tail);
+    u->cq_mask = (unsigned*)((uint8_t*)u->cq_ptr + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((uint8_t*)u->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+// Release an io_uring instance.
+static void uring_free(serial_uring_t* u)
+{
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_len != 0) {
+        munmap(u->cq_ptr, u->cq_len);
+    }
+    munmap(u->sq_ptr, u->sq_len);
+    close(u->fd);
+}
+
+// Queue a submission entry, it is sent by the next uring_enter.
+static struct io_uring_sqe* uring_get_sqe(serial_uring_t* u)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) {
+        return NULL;
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+// Submit queued entries and wait for at least wait completions.
+static int uring_enter(serial_uring_t* u, unsigned wait)
+{
+    int res = syscall(__NR_io_uring_enter, u->fd, u->pending, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res >= 0) {
+        u->pending -= res;
+    }
+    return res;
+}
+
+// Queue a read of the device, from the registered buffer if fixed is set.
+static int uring_post_read(serial_uring_t* u, int fd, uint8_t* buff, int size, int fixed)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buff;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = SERIAL_URING_RX;
+    return 0;
+}
+
+// Post a read into the rx buffer's free space, or the scratch buffer if it is full.
+// Returns 1 if the read targets the rx buffer.
+static int serial_uring_post_rx(serial_t* s, serial_uring_t* u, uint8_t* buff, int fixed)
+{
+    struct iovec iov[2];
+
+    //Only the first region, the consumer never writes into free space so it stays ours.
+    if (ring_write_regions(&s->rxbuff, iov) > 0) {
+        uring_post_read(u, s->fd, iov[0].iov_base, iov[0].iov_len, fixed);
+        return 1;
+    }
+    uring_post_read(u, s->fd, buff, BUFF_SIZE, 0);
+    return 0;
+}
+
+// Set up the listener's io_uring.
+static int serial_uring_create(serial_t* s)
+{
+    serial_uring_t* u = malloc(sizeof(serial_uring_t));
+
+    if (u == NULL) {
+        return -1;
+    }
+    if (uring_init(u, SERIAL_URING_ENTRIES) < 0) {
+        free(u);
+        return -1;
+    }
+    //Queued TX data is written from the ring, kicked through an eventfd.
+    if (s->tx_queued) {
+        s->txwakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (s->txwakefd < 0) {
+            uring_free(u);
+            free(u);
+            return -1;
+        }
+    }
+    s->tx_busy = 0;
+    s->uring_ctx = u;
+    return 0;
+}
+
+// Release the listener's io_uring.
+static void serial_uring_destroy(serial_t* s)
+{
+    if (s->uring_ctx == NULL) {
+        return;
+    }
+    //Closing the ring cancels outstanding requests.
+    uring_free(s->uring_ctx);
+    free(s->uring_ctx);
+    s->uring_ctx = NULL;
+    if (s->txwakefd >= 0) {
+        close(s->txwakefd);
+        s->txwakefd = -1;
+    }
+}
+
+// Queue a read of the TX kick eventfd, completing drains it.
+static void serial_uring_post_kick(serial_t* s, serial_uring_t* u, uint64_t* value)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->txwakefd;
+    sqe->addr = (uintptr_t)value;
+    sqe->len = sizeof(*value);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = SERIAL_URING_TXWAKE;
+}
+
+// Queue a write of everything in the TX queue, unless one is in flight.
+static void serial_uring_post_tx(serial_t* s, serial_uring_t* u, struct iovec iov[2])
+{
+    struct io_uring_sqe* sqe;
+    int count;
+
+    if (s->tx_busy) {
+        return;
+    }
+    pthread_mutex_lock(&s->tx_lock);
+    if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+        //The descriptor is parked while reconnecting, drop what was queued.
+        ring_consume(&s->txbuff, ring_available(&s->txbuff));
+        pthread_cond_broadcast(&s->tx_done_cond);
+    }
+    count = ring_read_regions(&s->txbuff, iov);
+    pthread_mutex_unlock(&s->tx_lock);
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        iov[1].iov_len = 0;
+    }
+    sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = s->txfd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = count;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = SERIAL_URING_TX;
+    __atomic_store_n(&s->tx_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+// Handle a completed TX write and queue the next one.
+static void serial_uring_tx_done(serial_t* s, serial_uring_t* u, struct iovec iov[2], int res)
+{
+    size_t offered = iov[0].iov_len + iov[1].iov_len;
+    int failed = 0;
+
+    pthread_mutex_lock(&s->tx_lock);
+    if (res >= 0) {
+        serial_stat_write(s, offered, res);
+        ring_consume(&s->txbuff, res);
+    } else if (!__atomic_load_n(&s->link_up, __ATOMIC_ACQUIRE)) {
+        //Link is down and being recovered, drop what was queued.
+        ring_consume(&s->txbuff, ring_available(&s->txbuff));
+    } else {
+        //Drop the queue and fail pending and future sends.
+        s->tx_error = -res;
+        ring_clear(&s->txbuff);
+        failed = 1;
+    }
+    pthread_cond_broadcast(&s->tx_done_cond);
+    pthread_mutex_unlock(&s->tx_lock);
+
+    //Pairs with serial_tx_kick, data queued before this store is seen below.
+    __atomic_store_n(&s->tx_busy, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!failed) {
+        serial_uring_post_tx(s, u, iov);
+    }
+}
+
+//io_uring serial data listener thread.
+static void *serial_data_listener_uring(void *param)
+{
+    serial_t* serial = (serial_t*) param;
+    ring_t* ring = &serial->rxbuff;
+    serial_uring_t* u = serial->uring_ctx;
+    struct io_uring_sqe* sqe;
+    struct iovec reg;
+    struct iovec tx_iov[2];
+    uint64_t kick;
+    uint8_t buff[BUFF_SIZE];
+    int fixed;
+    int in_place;
+    int done = 0;
+    int busy = serial->thread_config.busy_poll_us;
+    uint64_t spin_until = 0;
+    int spinning = 0;
+
+    //Register the rx buffer to skip per-read page pinning, plain reads work without.
+    reg.iov_base = ring->data;
+    reg.iov_len = ring->mirrored ? 2 * (size_t)ring->size : ring->size;
+    fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &reg, 1) == 0;
+
+    //Post the shutdown wakeup and the first read.
+    sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = serial->wakefd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = SERIAL_URING_WAKE;
+    in_place = serial_uring_post_rx(serial, u, buff, fixed);
+    if (serial->txwakefd >= 0) {
+        serial_uring_post_kick(serial, u, &kick);
+    }
+
+    //Run until ended.
+    while (!done && __atomic_load_n(&serial->running, __ATOMIC_ACQUIRE) != 0) {
+        //Submit anything queued and wait for a completion in one call.
+        //Inside the busy poll window completions are reaped straight from
+        //the shared ring, entering the kernel only to submit.
+        if (spinning && serial_now_us() >= spin_until) {
+            spinning = 0;
+        }
+        if ((!spinning || u->pending > 0) && uring_enter(u, spinning ? 0 : 1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error: io_uring error in serial thread\r\n");
+            break;
+        }
+        //Reap completions.
+        unsigned head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+            if (user_data == SERIAL_URING_WAKE) {
+                done = 1;
+                break;
+            }
+            if (user_data == SERIAL_URING_TX) {
+                serial_uring_tx_done(serial, u, tx_iov, res);
+                continue;
+            }
+            if (user_data == SERIAL_URING_TXWAKE) {
+                //New data was queued while no write was in flight.
+                serial_uring_post_tx(serial, u, tx_iov);
+                serial_uring_post_kick(serial, u, &kick);
+                continue;
+            }
+            __atomic_store_n(&serial->stats.rx_wakeups,
+                             serial->stats.rx_wakeups + 1, __ATOMIC_RELAXED);
+            serial_stat_read(serial, res);
+            if (res > 0 && busy > 0) {
+                //More is likely to follow, keep polling for a while.
+                spin_until = serial_now_us() + busy;
+                spinning = 1;
+            }
+            if (res > 0 && in_place) {
+                //Data landed in the rx buffer.
+                serial_rx_commit(serial, res);
+            } else if (res > 0) {
+                // Call the serial callback.
+                serial_rx_callback(serial, buff, res);
+            } else if (res != -EAGAIN && res != -EINTR) {
+                //Inform user.
+                printf("Error: Serial disconnect\r\n");
+                //Exit thread, unless the link is managed.
+                if (serial->reconnect_min <= 0) {
+                    done = 1;
+                    break;
+                }
+                serial_link_lost(serial);
+                serial_link_notify(serial, 0);
+                if (serial_link_recover(serial) < 0) {
+                    done = 1;
+                    break;
+                }
+            }
+            //Keep a read posted.
+            in_place = serial_uring_post_rx(serial, u, buff, fixed);
+        }
+    }
+
+    //Release anyone still waiting for data, the device is closed by serial_stop.
+    __atomic_store_n(&serial->link_up, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&serial->running, 0, __ATOMIC_RELEASE);
+    serial_rx_notify(serial);
+    //Nothing will write the queue any more, fail pending and future sends.
+    if (serial->txwakefd >= 0) {
+        pthread_mutex_lock(&serial->tx_lock);
+        if (serial->tx_error == 0) {
+            serial->tx_error = EPIPE;
+        }
+        pthread_cond_broadcast(&serial->tx_done_cond);
+        pthread_mutex_unlock(&serial->tx_lock);
     }
+    //The ring is released by serial_stop once this thread is joined.
+
+    return NULL;
+}
+#else
+//io_uring is not available, use the poll() listener.
+static int serial_uring_create(serial_t* s)
+{
+    return -1;
+}
+
+static void serial_uring_destroy(serial_t* s)
+{
+}
+
+static void *serial_data_listener_uring(void *param)
+{
+    return serial_data_listener(param);
+}
+#endif
 
+//Let the listener read without blocking while it busy polls.
+static void serial_rx_nonblock(serial_t* s)
+{
+    int flags = fcntl(s->fd, F_GETFL);
+
+    //Writes through a shared descriptor wait for POLLOUT on EAGAIN.
+    if (flags >= 0 && fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("serial_rx_nonblock");
+    }
 }
 
 //Serial data listener thread.
 static void *serial_data_listener(void *param)
 {
     int res = 0;
-    int err = 0;
-    struct pollfd ufds;
+    struct pollfd ufds[2];
     uint8_t buff[BUFF_SIZE];
 
     //Retrieve paramaters and store locally.
     serial_t* serial = (serial_t*) param;
     int fd = serial->fd;
+    int busy = serial->thread_config.busy_poll_us;
+    uint64_t spin_until = 0;
+    int spinning = 0;
 
     //Set up poll file descriptors.
-    ufds.fd = fd;        //Attach socket to watch.
-    ufds.events = POLLIN;        //Set events to notify on.
+    ufds[0].fd = fd;        //Attach socket to watch.
+    ufds[0].events = POLLIN;        //Set events to notify on.
+    ufds[1].fd = serial->wakefd;        //Attach shutdown wakeup.
+    ufds[1].events = POLLIN;
+
+    //Busy polling spins on reads, which must not block.
+    if (busy > 0) {
+        serial_rx_nonblock(serial);
+    }
 
     //Run until ended.
-    while (serial->running != 0) {
-        //Poll socket for data.
-        res = poll(&ufds, 1, POLL_TIMEOUT);
-        //If data was recieved.
-        if (res > 0) {
-            //Fetch the data.
-            int count = serial_recieve(serial, buff, BUFF_SIZE - 1);
-            //If data was recieved.
-            if (count > 0) {
-                //Pad end of buffer to ensure there is a termination symbol.
-                buff[count] = '\0';
-                // Call the serial callback.
-                serial_rx_callback(serial, (char *)buff, count);
-                //If an error occured.
-            } else if (count < 0) {
+    while (__atomic_load_n(&serial->running, __ATOMIC_ACQUIRE) != 0) {
+        int count;
+        if (spinning) {
+            //Inside the busy poll window, try a read instead of sleeping.
+            count = serial_service_rx(serial, buff, BUFF_SIZE);
+            if (count == 0 && serial_now_us() >= spin_until) {
+                spinning = 0;
+            }
+        } else {
+            //Poll socket for data, serial_stop wakes us to exit.
+            res = poll(ufds, 2, -1);
+            //If there was an error.
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
                 //Inform user and exit thread.
-                printf("Error: Serial disconnect\r\n");
-                err = 1;
+                printf("Error: Polling error in serial thread\r\n");
                 break;
             }
-            //If there was an error.
-        } else if (res < 0) {
-            //Inform user and exit thread.
-            printf("Error: Polling error in serial thread");
-            err = 1;
-            break;
+            if (ufds[1].revents) {
+                break;
+            }
+            __atomic_store_n(&serial->stats.rx_wakeups,
+                             serial->stats.rx_wakeups + 1, __ATOMIC_RELAXED);
+            //Fetch the data.
+            count = serial_service_rx(serial, buff, BUFF_SIZE);
+            if (count == 0 && (ufds[0].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                count = -1;
+            }
+        }
+        //More is likely to follow, keep polling for a while.
+        if (count > 0 && busy > 0) {
+            spin_until = serial_now_us() + busy;
+            spinning = 1;
+        }
+        //If an error occured.
+        if (count < 0) {
+            //Inform user.
+            printf("Error: Serial disconnect\r\n");
+            spinning = 0;
+            //Exit thread, unless the link is managed.
+            if (serial->reconnect_min <= 0) {
+                break;
+            }
+            serial_link_lost(serial);
+            serial_link_notify(serial, 0);
+            if (serial_link_recover(serial) < 0) {
+                break;
+            }
+            //The reopened device starts out blocking.
+            if (busy > 0) {
+                serial_rx_nonblock(serial);
+            }
         }
-        //Otherwise, keep going around.
-    }
-    //If there was an error, close socket.
-    if (err) {
-        serial_close(serial);
-        //raise(SIGLOST);
     }
-    //Close file.
-    res = close(serial->fd);
+    //Release anyone still waiting for data, the device is closed by serial_stop.
+    __atomic_store_n(&serial->link_up, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&serial->running, 0, __ATOMIC_RELEASE);
+    serial_rx_notify(serial);
 
     return NULL;
-}
\ No newline at end of file
+}
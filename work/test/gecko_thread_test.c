@@ -0,0 +1,276 @@
+/*
+ * BGLib background decode thread test, build with BGLIB_THREAD.
+ * A fake device on the other end of a socketpair answers soft timer
+ * commands, sending the number of timer events asked for in the time
+ * field before each response. With single_shot set they follow the
+ * response instead, as the blocking policy drops events while a command
+ * waits. Events carry a running sequence number in their handle,
+ * responses return the command's handle as the result.
+ *
+ * Usage: gecko_thread_test [stop]
+ * With "stop" only starting and stopping the thread is checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "gecko_bglib.h"
+
+BGLIB_DEFINE();
+
+#define TEST_COMMANDS 500    //>! Commands sent while events are read.
+#define TEST_EVENTS 3        //>! Events sent before each response.
+#define TEST_FLOOD 5000      //>! Events sent at once into a small blocking queue.
+#define TEST_QUEUE 4096      //>! Small queue for the blocking policy.
+
+static int test_fds[2];
+static uint32_t test_queue[TEST_QUEUE / 4];
+static int test_expected;
+static int test_received;
+static int test_bad;
+
+// Host side of the socketpair.
+static void test_output(uint16 len, uint8* data)
+{
+    if (write(test_fds[0], data, len) != len) {
+        perror("test_output");
+    }
+}
+
+static int test_input(uint16 len, uint8* data)
+{
+    while (len > 0) {
+        ssize_t res = read(test_fds[0], data, len);
+        if (res <= 0) {
+            return -1;
+        }
+        data += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int test_peek(void)
+{
+    int count = 0;
+    ioctl(test_fds[0], FIONREAD, &count);
+    return count;
+}
+
+static int test_pollfd(void)
+{
+    return test_fds[0];
+}
+
+// Monotonic time in milliseconds.
+static double test_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Fake device, runs until the host closes its end.
+static void* test_device(void* param)
+{
+    uint8_t seq = 0;
+    uint8_t cmd[BGLIB_MSG_HEADER_LEN + sizeof(struct gecko_msg_hardware_set_soft_timer_cmd_t)];
+
+    while (1) {
+        struct gecko_msg_hardware_set_soft_timer_cmd_t req;
+        uint8_t evt[BGLIB_MSG_HEADER_LEN + 1];
+        uint8_t rsp[BGLIB_MSG_HEADER_LEN + 2];
+        uint32_t header;
+        size_t got = 0;
+        uint32_t i;
+
+        while (got < sizeof(cmd)) {
+            ssize_t res = read(test_fds[1], cmd + got, sizeof(cmd) - got);
+            if (res <= 0) {
+                return NULL;
+            }
+            got += res;
+        }
+        memcpy(&req, cmd + BGLIB_MSG_HEADER_LEN, sizeof(req));
+
+        header = gecko_rsp_hardware_set_soft_timer_id | (2 << 8);
+        memcpy(rsp, &header, sizeof(header));
+        rsp[BGLIB_MSG_HEADER_LEN] = req.handle;
+        rsp[BGLIB_MSG_HEADER_LEN + 1] = 0;
+        if (req.single_shot && write(test_fds[1], rsp, sizeof(rsp)) != sizeof(rsp)) {
+            return NULL;
+        }
+        header = gecko_evt_hardware_soft_timer_id | (1 << 8);
+        memcpy(evt, &header, sizeof(header));
+        for (i = 0; i < req.time; i++) {
+            evt[BGLIB_MSG_HEADER_LEN] = seq++;
+            if (write(test_fds[1], evt, sizeof(evt)) != sizeof(evt)) {
+                return NULL;
+            }
+        }
+        if (!req.single_shot && write(test_fds[1], rsp, sizeof(rsp)) != sizeof(rsp)) {
+            return NULL;
+        }
+    }
+}
+
+// Read events until the expected number have arrived or been dropped.
+static void* test_reader(void* param)
+{
+    int slow = *(int*) param;
+    struct gecko_queue_stats stats;
+    int first = 1;
+    uint8_t next = 0;
+
+    while (1) {
+        struct gecko_cmd_packet* evt;
+
+        gecko_get_queue_stats(&stats);
+        if (test_received + (int) stats.dropped_newest >= test_expected) {
+            break;
+        }
+        evt = gecko_peek_event();
+        if (evt == NULL) {
+            usleep(100);
+            continue;
+        }
+        if (BGLIB_MSG_ID(evt->header) != gecko_evt_hardware_soft_timer_id) {
+            test_bad++;
+            continue;
+        }
+        //Events may be dropped but never reordered.
+        if (!first && (uint8_t)(evt->data.evt_hardware_soft_timer.handle - next) >= 128) {
+            test_bad++;
+        }
+        next = evt->data.evt_hardware_soft_timer.handle + 1;
+        first = 0;
+        test_received++;
+        if (slow && test_received % 64 == 0) {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+// Send commands while another thread reads events.
+static int test_commands(void)
+{
+    pthread_t reader;
+    int slow = 0;
+    int i;
+
+    test_expected = TEST_COMMANDS * TEST_EVENTS;
+    test_received = 0;
+    pthread_create(&reader, NULL, test_reader, &slow);
+    for (i = 0; i < TEST_COMMANDS; i++) {
+        uint16_t result = gecko_cmd_hardware_set_soft_timer(TEST_EVENTS, (uint8_t) i, 0)->result;
+        if (result != (uint8_t) i) {
+            test_bad++;
+        }
+    }
+    pthread_join(reader, NULL);
+    printf("commands: %d sent, %d events received, %d bad\n", TEST_COMMANDS, test_received, test_bad);
+    return test_bad == 0 ? 0 : -1;
+}
+
+// Flood a small queue with the blocking policy, nothing may be dropped.
+static int test_block(void)
+{
+    struct gecko_queue_stats stats;
+    pthread_t reader;
+    int slow = 1;
+
+    gecko_set_queue(test_queue, sizeof(test_queue));
+    gecko_set_overflow_policy(gecko_overflow_block, 0);
+    gecko_start_thread();
+
+    test_expected = TEST_FLOOD;
+    test_received = 0;
+    pthread_create(&reader, NULL, test_reader, &slow);
+    if (gecko_cmd_hardware_set_soft_timer(TEST_FLOOD, 0, 1)->result != 0) {
+        test_bad++;
+    }
+    pthread_join(reader, NULL);
+    gecko_get_queue_stats(&stats);
+    printf("block: %d events received, %u dropped, %d bad\n", test_received,
+           (unsigned) stats.dropped_newest, test_bad);
+    return test_bad == 0 && test_received == TEST_FLOOD ? 0 : -1;
+}
+
+// Stop the thread while it waits for data, and check the device still works after.
+static int test_stop(void)
+{
+    double start;
+    double took;
+
+    usleep(10000);
+    start = test_now_ms();
+    gecko_stop_thread();
+    took = test_now_ms() - start;
+    printf("stop: %.1f ms\n", took);
+    if (took > 2 * BGLIB_THREAD_POLL_MS) {
+        return -1;
+    }
+    //Without the thread the command reads its own response.
+    if (gecko_cmd_hardware_set_soft_timer(0, 42, 0)->result != 42) {
+        return -1;
+    }
+    //Stopping twice is harmless.
+    gecko_stop_thread();
+    return 0;
+}
+
+// The thread exits by itself when the device goes away.
+static int test_hangup(void)
+{
+    double start;
+
+    gecko_start_thread();
+    shutdown(test_fds[1], SHUT_RDWR);
+    start = test_now_ms();
+    gecko_stop_thread();
+    printf("hangup: %.1f ms\n", test_now_ms() - start);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int stop_only = argc > 1 && strcmp(argv[1], "stop") == 0;
+    pthread_t device;
+    int failed = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pthread_create(&device, NULL, test_device, NULL);
+    BGLIB_INITIALIZE_POLLABLE(test_output, test_input, test_peek, test_pollfd);
+
+    if (gecko_start_thread() < 0) {
+        perror("gecko_start_thread");
+        return 1;
+    }
+    if (stop_only) {
+        failed |= test_stop();
+        gecko_start_thread();
+        failed |= test_stop();
+        failed |= test_hangup();
+    } else {
+        failed |= test_commands();
+        failed |= test_stop();
+        failed |= test_block();
+        failed |= test_stop();
+    }
+
+    close(test_fds[0]);
+    pthread_join(device, NULL);
+    close(test_fds[1]);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * TX queue frame integrity test.
+ * Several threads send frames over a loopback port at once, the reader
+ * checks that every frame arrives whole and in order per sender.
+ * Run with frames smaller and larger than the TX queue, for the poll()
+ * and io_uring backends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "uart.h"
+
+#define TEST_SENDERS 4       //>! Threads sending at once.
+#define TEST_TIMEOUT_MS 5000 //>! Longest wait for a frame.
+
+typedef struct test_sender_s {
+    serial_t* s;
+    int id;
+    int frames;
+    int size;
+    int failed;
+} test_sender_t;
+
+// Frame byte k of frame seq from sender id, bytes 0 and 1 hold id and seq.
+static uint8_t test_byte(int id, int seq, int k)
+{
+    return (uint8_t)(id * 31 + seq * 7 + k);
+}
+
+static void* test_send(void* param)
+{
+    test_sender_t* t = (test_sender_t*) param;
+    uint8_t* frame = malloc(t->size);
+    int seq;
+    int k;
+
+    for (seq = 0; seq < t->frames; seq++) {
+        frame[0] = t->id;
+        frame[1] = (uint8_t) seq;
+        for (k = 2; k < t->size; k++) {
+            frame[k] = test_byte(t->id, seq, k);
+        }
+        if (serial_send(t->s, frame, t->size) != t->size) {
+            perror("serial_send");
+            t->failed = 1;
+            break;
+        }
+    }
+    free(frame);
+    return NULL;
+}
+
+// Send frames of one size from every sender and check what arrives.
+static int test_run(int flags, int frames, int size)
+{
+    test_sender_t senders[TEST_SENDERS];
+    pthread_t threads[TEST_SENDERS];
+    int next[TEST_SENDERS];
+    uint8_t* frame = malloc(size);
+    int bad = 0;
+    serial_t* s;
+    int i;
+    int k;
+
+    //Hold everything sent, so a slow reader cannot lose data.
+    s = serial_create(TEST_SENDERS * frames * size, flags);
+    if (s == NULL || serial_connect(s, "loop:", 115200) < 0) {
+        perror("loop:");
+        return -1;
+    }
+    for (i = 0; i < TEST_SENDERS; i++) {
+        senders[i].s = s;
+        senders[i].id = i;
+        senders[i].frames = frames;
+        senders[i].size = size;
+        senders[i].failed = 0;
+        next[i] = 0;
+        pthread_create(&threads[i], NULL, test_send, &senders[i]);
+    }
+
+    for (i = 0; i < TEST_SENDERS * frames; i++) {
+        int id;
+        int seq;
+        if (serial_read_exact(s, frame, size, TEST_TIMEOUT_MS) != size) {
+            fprintf(stderr, "frame %d: timed out\n", i);
+            bad++;
+            break;
+        }
+        id = frame[0];
+        seq = frame[1];
+        if (id >= TEST_SENDERS || seq != (uint8_t) next[id]) {
+            bad++;
+            continue;
+        }
+        for (k = 2; k < size; k++) {
+            if (frame[k] != test_byte(id, next[id], k)) {
+                break;
+            }
+        }
+        if (k != size) {
+            bad++;
+        }
+        next[id]++;
+    }
+
+    for (i = 0; i < TEST_SENDERS; i++) {
+        pthread_join(threads[i], NULL);
+        bad += senders[i].failed;
+    }
+    serial_close(s);
+    serial_destroy(s);
+    free(frame);
+
+    printf("%s %d x %d bytes: %d bad\n", (flags & SERIAL_FLAG_URING) ? "io_uring" : "poll",
+           TEST_SENDERS * frames, size, bad);
+    return bad == 0 ? 0 : -1;
+}
+
+int main(void)
+{
+    static const int flags[] = { SERIAL_FLAG_TX_QUEUE, SERIAL_FLAG_TX_QUEUE | SERIAL_FLAG_URING };
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        failed |= test_run(flags[i], 1000, 1000);
+        failed |= test_run(flags[i], 100, SERIAL_TX_SIZE + 1904);
+    }
+    return failed ? 1 : 0;
+}
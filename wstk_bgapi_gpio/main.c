@@ -47,7 +47,11 @@ BGLIB_DEFINE();
  */
 
 /** The default serial port to use for BGAPI communication. */
+#ifdef _WIN32
 uint8_t* default_uart_port = "COM1";
+#else
+uint8_t* default_uart_port = "/dev/ttyACM0";
+#endif /* _WIN32 */
 
 /** The default baud rate to use. */
 uint32_t default_baud_rate = 115200;
@@ -99,7 +103,8 @@ static void on_message_send(uint16 msg_len, uint8* msg_data)
 
 int hw_init(int argc, char* argv[])
 {
-    char tmpbaud[10];
+    /** Kept for the lifetime of the program, uart_port points into it. */
+    static char tmpbaud[64];
 
     /**
     * Handle the command-line arguments.
@@ -120,8 +125,12 @@ int hw_init(int argc, char* argv[])
 
     if (!uart_port)
     { /*no uart port given, ask from user*/
-        printf("Serial port to use (e.g. COM11): ");
+        printf("Serial port to use (e.g. %s): ", default_uart_port);
+#ifdef _WIN32
         if (scanf_s("%s", tmpbaud, sizeof(tmpbaud)) == 1)
+#else
+        if (scanf("%63s", tmpbaud) == 1)
+#endif /* _WIN32 */
         {
             uart_port = tmpbaud;
         }
@@ -48,4 +48,12 @@ int uart_tx(uint16_t data_length, uint8_t* data);
  * @return nonzero if there is data in uart
  */
 int uart_peek(void);
+
+/**
+ * File descriptor that becomes readable when there is data to be received,
+ * for use with an external poll loop.
+ *
+ * @return file descriptor, or -1 if not supported
+ */
+int uart_pollable_fd(void);
 #endif /* UART_H */
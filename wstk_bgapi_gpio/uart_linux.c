@@ -0,0 +1,143 @@
+/**
+ * uart_linux.c
+ *
+ * Linux implementation of uart.h on top of the threaded serial_t port.
+ * A listener thread fills the receive ring, so uart_rx is served from
+ * buffered data and uart_peek only checks the ring occupancy.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include "uart.h"
+#include "../work/include/uart.h"
+
+/** Receive ring size, large enough for several maximum length BGAPI packets. */
+#define UART_RX_SIZE 8192
+
+/** The serial port. NULL if none. */
+static serial_t* uart_serial = NULL;
+
+int uart_open(unsigned char* port, uint32_t baudrate)
+{
+    serial_config_t config;
+
+#ifdef _DEBUG
+    printf("uart_open() - port: %s, baudrate: %d\n", port, baudrate);
+#endif /* _DEBUG */
+
+    if(uart_serial == NULL)
+    {
+        uart_serial = serial_create(UART_RX_SIZE, 0);
+        if(uart_serial == NULL)
+        {
+            return -1;
+        }
+    }
+
+    /** 8N1 with RTS/CTS handshake, as the NCP firmware expects. */
+    serial_config_init(&config, baudrate);
+    config.rtscts = 1;
+
+    if(serial_connect_config(uart_serial, (const char*)port, &config) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void uart_close()
+{
+#if _DEBUG
+    printf("uart_close()\n");
+#endif /* _DEBUG */
+
+    if(uart_serial != NULL)
+    {
+        serial_destroy(uart_serial);
+        uart_serial = NULL;
+    }
+}
+
+int uart_rx(uint16_t data_length, uint8_t* data)
+{
+    /** The amount of bytes read. */
+    int data_read;
+
+#if _DEBUG
+    printf("uart_rx() - data_length: %d\n", data_length);
+#endif /* _DEBUG */
+
+    if(uart_serial == NULL)
+    {
+        return -1;
+    }
+
+    /** Copy out of the receive ring, only sleeping if it runs dry. */
+    data_read = serial_read_exact(uart_serial, data, data_length, -1);
+    if(data_read != data_length)
+    {
+        return -1;
+    }
+
+#if _DEBUG
+    for(data_read = 0; data_read < data_length; ++data_read)
+    {
+        printf("%02X", data[data_read]);
+    }
+    printf("\n");
+#endif /* _DEBUG */
+
+    return data_length;
+}
+
+int uart_tx(uint16_t data_length, uint8_t* data)
+{
+    /** Variable for storing function return values. */
+    int ret;
+    struct iovec iov = { data, data_length };
+
+#if _DEBUG
+    printf("uart_tx() - data_length: %d\n", data_length);
+    for(ret = 0; ret < data_length; ++ret)
+    {
+        printf("%02X", data[ret]);
+    }
+    printf("\n");
+#endif /* _DEBUG */
+
+    if(uart_serial == NULL)
+    {
+        return -1;
+    }
+
+    /** Writes the whole packet, retrying short writes. */
+    ret = serial_writev(uart_serial, &iov, 1);
+    if(ret != data_length)
+    {
+        return -1;
+    }
+
+    return data_length;
+}
+
+int uart_peek(void)
+{
+    if(uart_serial == NULL)
+    {
+        return 0;
+    }
+
+    return serial_available(uart_serial);
+}
+
+int uart_pollable_fd(void)
+{
+    if(uart_serial == NULL)
+    {
+        return -1;
+    }
+
+    return serial_pollable_fd(uart_serial);
+}
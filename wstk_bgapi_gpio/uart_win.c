@@ -171,3 +171,9 @@ int uart_peek(void)
 
     return((int)ComStat.cbInQue);
 }
+
+int uart_pollable_fd(void)
+{
+    /** Handles cannot be used with poll. */
+    return -1;
+}